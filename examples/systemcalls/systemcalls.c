@@ -1,4 +1,14 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 /**
  * @param cmd the command to execute with system()
@@ -160,3 +170,542 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
 
 	return true;
 }
+
+static double monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void reap_child(struct exec_result *result)
+{
+	int status;
+	while(waitpid(result->pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			perror("waitpid error");
+			result->status = -1;
+			result->success = false;
+			result->wall_ms = monotonic_ms() - result->wall_ms;
+			return;
+		}
+	}
+	result->status = status;
+	result->success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	result->wall_ms = monotonic_ms() - result->wall_ms;
+}
+
+/* reap @param result if its child has exited, without blocking */
+static bool try_reap_child(struct exec_result *result)
+{
+	int status;
+	pid_t rc;
+	while((rc = waitpid(result->pid, &status, WNOHANG)) < 0 && errno == EINTR) {
+	}
+	if(rc == 0) {
+		return false;
+	}
+	if(rc < 0) {
+		perror("waitpid error");
+		status = -1;
+	}
+	result->status = status;
+	result->success = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	result->wall_ms = monotonic_ms() - result->wall_ms;
+	return true;
+}
+
+/* epoll tag of the SIGCHLD signalfd, pidfd tags carry the command index */
+#define SIGCHLD_TAG UINT64_MAX
+/* also sweep the SIGCHLD fallback children this often, see below */
+#define SIGCHLD_SWEEP_MS 100
+
+/**
+ * @param commands - An array of @param count NULL terminated argv vectors.
+ *   As with do_exec(), argv[0] of every command must be an absolute path.
+ * @param count - The number of commands in @param commands
+ * @param max_parallel - The maximum number of children running at once,
+ *   0 to use the number of online CPUs.
+ * @param results - An array of @param count entries filled with the pid,
+ *   wait status and wall time of each command, in the order of @param commands.
+ *   Commands that were never started have a pid of -1.
+ * @return true if every command was started and exited with status 0,
+ *   false otherwise.  Inspect @param results for the per-command outcome.
+ *
+ * Unlike calling do_exec() in a loop, children are reaped as they complete:
+ * every child gets a pidfd registered with epoll, so the batch takes roughly
+ * as long as its slowest command rather than the sum of all of them.  If the
+ * kernel has no pidfd support, SIGCHLD is blocked for the duration of the
+ * call and read from a signalfd on the same epoll set instead.  A SIGCHLD
+ * taken by another thread that does not block it is covered by a periodic
+ * non-blocking sweep of those children.
+ */
+bool do_exec_many(char * const *commands[], size_t count, size_t max_parallel,
+		struct exec_result *results)
+{
+	bool all_ok = true;
+	size_t next = 0;
+	size_t running = 0;
+	size_t fallback_running = 0;
+
+	for(size_t i = 0; i < count; i++) {
+		results[i].pid = -1;
+		results[i].status = -1;
+		results[i].success = false;
+		results[i].wall_ms = 0;
+	}
+	if(max_parallel == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		max_parallel = cpus > 0 ? (size_t)cpus : 1;
+	}
+
+	//children still to be reaped through the SIGCHLD fallback instead of a pidfd,
+	//cleared once reaped: a failed waitpid leaves status -1, so that is no marker
+	bool *fallback = calloc(count ? count : 1, sizeof(*fallback));
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0 || !fallback) {
+		perror("epoll_create1 error");
+		free(fallback);
+		if(epfd >= 0) {
+			close(epfd);
+		}
+		return false;
+	}
+
+	//blocked before the first fork so no SIGCHLD can be lost to the signalfd
+	sigset_t chld, old_mask;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &chld, &old_mask);
+	int sigfd = -1;
+
+	while(next < count || running > 0) {
+		//top up the running set
+		while(running < max_parallel && next < count) {
+			size_t idx = next++;
+			struct exec_result *result = &results[idx];
+
+			if(commands[idx] == NULL || commands[idx][0] == NULL || commands[idx][0][0] != '/') {
+				printf("absolute path not used for command %zu\n", idx);
+				all_ok = false;
+				continue;
+			}
+
+			fflush(stdout);
+			result->wall_ms = monotonic_ms();
+			pid_t pid = fork();
+			if(pid < 0) {
+				perror("fork error");
+				result->wall_ms = 0;
+				all_ok = false;
+				continue;
+			}
+			if(pid == 0) {
+				//child
+				pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+				execv(commands[idx][0], commands[idx]);
+				perror("execv error");
+				_exit(1);
+			}
+			result->pid = pid;
+			running++;
+
+			int pidfd = open_pidfd(pid);
+			struct epoll_event ev = {
+				.events = EPOLLIN,
+				.data.u64 = ((uint64_t)idx << 32) | (uint32_t)pidfd,
+			};
+			if(pidfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &ev) == 0) {
+				continue;
+			}
+			//no pidfd support, wait for SIGCHLD instead
+			if(pidfd >= 0) {
+				close(pidfd);
+			}
+			if(sigfd < 0) {
+				sigfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+				struct epoll_event sev = { .events = EPOLLIN, .data.u64 = SIGCHLD_TAG };
+				if(sigfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sev) < 0) {
+					perror("signalfd error");
+					if(sigfd >= 0) {
+						close(sigfd);
+						sigfd = -1;
+					}
+				}
+			}
+			fallback[idx] = true;
+			fallback_running++;
+		}
+
+		if(running == 0) {
+			continue;
+		}
+
+		struct epoll_event events[16];
+		int timeout = fallback_running > 0 ? SIGCHLD_SWEEP_MS : -1;
+		int n = epoll_wait(epfd, events, 16, timeout);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait error");
+			break;
+		}
+		bool sweep = n == 0;
+		for(int i = 0; i < n; i++) {
+			if(events[i].data.u64 == SIGCHLD_TAG) {
+				struct signalfd_siginfo si;
+				while(read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+				}
+				sweep = true;
+				continue;
+			}
+			size_t idx = events[i].data.u64 >> 32;
+			int pidfd = (int)(uint32_t)events[i].data.u64;
+			reap_child(&results[idx]);
+			all_ok = all_ok && results[idx].success;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, pidfd, NULL);
+			close(pidfd);
+			running--;
+		}
+		//SIGCHLD coalesces, so check every fallback child still running
+		for(size_t i = 0; sweep && fallback_running > 0 && i < next; i++) {
+			if(fallback[i] && try_reap_child(&results[i])) {
+				fallback[i] = false;
+				all_ok = all_ok && results[i].success;
+				fallback_running--;
+				running--;
+			}
+		}
+	}
+
+	//only reached with children outstanding if epoll_wait failed
+	if(running > 0) {
+		for(size_t i = 0; i < next; i++) {
+			if(results[i].pid > 0 && results[i].status == -1) {
+				reap_child(&results[i]);
+			}
+		}
+		all_ok = false;
+	}
+	if(sigfd >= 0) {
+		close(sigfd);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	close(epfd);
+	free(fallback);
+
+	return all_ok;
+}
+
+#define CAPTURE_CHUNK 65536
+
+/*
+ * Append @param len bytes to a NUL terminated growable buffer, honoring the
+ * combined max_bytes limit of @param cap.
+ */
+static bool capture_append(struct exec_capture *cap, char **buf, size_t *buf_len,
+		size_t *buf_cap, const char *data, size_t len)
+{
+	if(cap->max_bytes) {
+		size_t used = cap->out_len + cap->err_len;
+		size_t room = used < cap->max_bytes ? cap->max_bytes - used : 0;
+		if(len > room) {
+			cap->truncated = true;
+			len = room;
+		}
+	}
+	if(len == 0) {
+		return true;
+	}
+	if(*buf_len + len + 1 > *buf_cap) {
+		size_t new_cap = *buf_cap ? *buf_cap : 4096;
+		while(new_cap < *buf_len + len + 1) {
+			new_cap *= 2;
+		}
+		char *new_buf = realloc(*buf, new_cap);
+		if(!new_buf) {
+			perror("realloc error");
+			return false;
+		}
+		*buf = new_buf;
+		*buf_cap = new_cap;
+	}
+	memcpy(*buf + *buf_len, data, len);
+	*buf_len += len;
+	(*buf)[*buf_len] = '\0';
+	return true;
+}
+
+/*
+ * Duplicate whatever is queued in @param pipe_fd into @param tee_fd without
+ * copying through userspace.  Returns the number of bytes now safe to read()
+ * from @param pipe_fd, 0 at EOF, or -1 if tee/splice is unusable.
+ */
+static ssize_t capture_tee(int pipe_fd, int tee_pipe[2], int tee_fd)
+{
+	ssize_t n = tee(pipe_fd, tee_pipe[1], CAPTURE_CHUNK, 0);
+	if(n <= 0) {
+		return n;
+	}
+	ssize_t moved = 0;
+	while(moved < n) {
+		ssize_t m = splice(tee_pipe[0], NULL, tee_fd, NULL, n - moved, SPLICE_F_MOVE);
+		if(m <= 0) {
+			if(m < 0 && errno == EINTR) {
+				continue;
+			}
+			perror("splice error");
+			return -1;
+		}
+		moved += m;
+	}
+	return n;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Reap @param pid if it exits within @param timeout_ms, waiting on a pidfd
+ * where available and polling with WNOHANG otherwise.
+ * Returns true once reaped (@param status is -1 if waitpid failed), false
+ * if the child is still running at the deadline.
+ */
+static bool wait_child_timeout(pid_t pid, long timeout_ms, int *status)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int pidfd = open_pidfd(pid);
+	bool reaped = false;
+	for(;;) {
+		pid_t rc = waitpid(pid, status, WNOHANG);
+		if(rc == pid) {
+			reaped = true;
+			break;
+		}
+		if(rc < 0 && errno != EINTR) {
+			perror("waitpid error");
+			*status = -1;
+			reaped = true;
+			break;
+		}
+		long left = timeout_ms - elapsed_ms(&start);
+		if(left <= 0) {
+			break;
+		}
+		if(pidfd >= 0) {
+			struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+			poll(&pfd, 1, left);
+		} else {
+			struct timespec step = { 0, (left < 10 ? left : 10) * 1000000L };
+			nanosleep(&step, NULL);
+		}
+	}
+	if(pidfd >= 0) {
+		close(pidfd);
+	}
+	return reaped;
+}
+
+/**
+ * @param cap - Options and results, see struct exec_capture.  The out_buf
+ *   and err_buf members are allocated here and must be freed by the caller,
+ *   even when false is returned.
+ * All other parameters, see do_exec above
+ * @return true if the command ran to completion and exited with status 0,
+ *   false on any error, on a timeout, or if the callback aborted the capture.
+ *
+ * The child's stdout and stderr are read through pipes straight into memory,
+ * so callers no longer have to round-trip the output through a temporary
+ * file.  When tee_file is set stdout is additionally copied to that file with
+ * tee()/splice(), keeping the file copy in the kernel.
+ */
+bool do_exec_capture(struct exec_capture *cap, int count, ...)
+{
+	va_list args;
+	va_start(args, count);
+	char * command[count+1];
+	int i;
+	for(i=0; i<count; i++)
+	{
+		command[i] = va_arg(args, char *);
+	}
+	command[count] = NULL;
+	va_end(args);
+
+	cap->out_buf = cap->err_buf = NULL;
+	cap->out_len = cap->err_len = 0;
+	cap->status = -1;
+	cap->truncated = false;
+	cap->timed_out = false;
+	if(command[0][0] != '/') {
+		printf("absolute path not used, returning");
+		return false;
+	}
+
+	int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+	int tee_pipe[2] = {-1, -1}, tee_fd = -1;
+	bool ok = false;
+	if(pipe2(out_pipe, O_CLOEXEC) < 0 || pipe2(err_pipe, O_CLOEXEC) < 0) {
+		perror("pipe error");
+		goto out_close;
+	}
+	if(cap->tee_file) {
+		tee_fd = open(cap->tee_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(tee_fd < 0 || pipe2(tee_pipe, O_CLOEXEC) < 0) {
+			perror("tee file open error");
+			goto out_close;
+		}
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0) {
+		perror("fork error");
+		goto out_close;
+	}
+	if(pid == 0) {
+		//child: route stdout and stderr into the pipes
+		dup2(out_pipe[1], STDOUT_FILENO);
+		dup2(err_pipe[1], STDERR_FILENO);
+		execv(command[0], command);
+		perror("execv error");
+		_exit(1);
+	}
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+	out_pipe[1] = err_pipe[1] = -1;
+
+	size_t out_cap = 0, err_cap = 0;
+	bool aborted = false;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct pollfd pfds[2] = {
+		{ .fd = out_pipe[0], .events = POLLIN },
+		{ .fd = err_pipe[0], .events = POLLIN },
+	};
+	char chunk[CAPTURE_CHUNK];
+
+	while(!aborted && (pfds[0].fd >= 0 || pfds[1].fd >= 0)) {
+		int wait_ms = -1;
+		if(cap->timeout_ms > 0) {
+			long elapsed = elapsed_ms(&start);
+			if(elapsed >= cap->timeout_ms) {
+				cap->timed_out = true;
+				break;
+			}
+			wait_ms = cap->timeout_ms - elapsed;
+		}
+		int n = poll(pfds, 2, wait_ms);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("poll error");
+			aborted = true;
+			break;
+		}
+		for(int s = 0; s < 2 && !aborted; s++) {
+			if(pfds[s].fd < 0 || !(pfds[s].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			size_t want = sizeof(chunk);
+			if(s == 0 && tee_fd >= 0) {
+				ssize_t teed = capture_tee(pfds[s].fd, tee_pipe, tee_fd);
+				if(teed < 0) {
+					aborted = true;
+					break;
+				}
+				//0 means EOF, let read() below observe it
+				if(teed > 0) {
+					want = teed;
+				}
+			}
+			//read exactly what was teed so the file and memory copies match
+			size_t got = 0;
+			ssize_t r = 0;
+			do {
+				r = read(pfds[s].fd, chunk + got, want - got);
+				if(r > 0) {
+					got += r;
+				}
+			} while((r > 0 && s == 0 && tee_fd >= 0 && got < want) || (r < 0 && errno == EINTR));
+			if(got == 0) {
+				if(r < 0) {
+					perror("read error");
+				}
+				close(pfds[s].fd);
+				pfds[s].fd = -1;
+				if(s == 0) {
+					out_pipe[0] = -1;
+				} else {
+					err_pipe[0] = -1;
+				}
+				continue;
+			}
+			int stream = s == 0 ? STDOUT_FILENO : STDERR_FILENO;
+			if(cap->callback && cap->callback(stream, chunk, got, cap->callback_ctx) != 0) {
+				aborted = true;
+				break;
+			}
+			bool stored = s == 0 ?
+				capture_append(cap, &cap->out_buf, &cap->out_len, &out_cap, chunk, got) :
+				capture_append(cap, &cap->err_buf, &cap->err_len, &err_cap, chunk, got);
+			if(!stored) {
+				aborted = true;
+			}
+		}
+	}
+
+	int status = -1;
+	bool reaped = false;
+	//a child can close its output and keep running, the timeout covers that too
+	if(cap->timeout_ms > 0 && !aborted && !cap->timed_out) {
+		reaped = wait_child_timeout(pid, cap->timeout_ms - elapsed_ms(&start), &status);
+		cap->timed_out = !reaped;
+	}
+	if(aborted || cap->timed_out) {
+		kill(pid, SIGKILL);
+	}
+	while(!reaped && waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			perror("waitpid error");
+			status = -1;
+			break;
+		}
+	}
+	cap->status = status;
+	if(status != -1 && WIFEXITED(status)) {
+		printf("child returned with status %d\n", WEXITSTATUS(status));
+	}
+	ok = !aborted && !cap->timed_out && status != -1 &&
+		WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+out_close:
+	for(i = 0; i < 2; i++) {
+		if(out_pipe[i] >= 0) close(out_pipe[i]);
+		if(err_pipe[i] >= 0) close(err_pipe[i]);
+		if(tee_pipe[i] >= 0) close(tee_pipe[i]);
+	}
+	if(tee_fd >= 0) {
+		close(tee_fd);
+	}
+	return ok;
+}
@@ -13,3 +13,58 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Outcome of one command launched by do_exec_many().
+ */
+struct exec_result {
+	/** pid of the child, or -1 if it could not be started */
+	pid_t pid;
+	/** raw wait status as returned by waitid()/waitpid() */
+	int status;
+	/** true if the command exited normally with status 0 */
+	bool success;
+	/** wall time from fork to reap, in milliseconds */
+	double wall_ms;
+};
+
+bool do_exec_many(char * const *commands[], size_t count, size_t max_parallel,
+		struct exec_result *results);
+
+/**
+ * Callback invoked by do_exec_capture() for every chunk read from the child.
+ * @param stream STDOUT_FILENO or STDERR_FILENO
+ * @return 0 to continue, non-zero to stop capturing and kill the child
+ */
+typedef int (*exec_output_cb)(int stream, const char *data, size_t len, void *ctx);
+
+/**
+ * In/out parameters of do_exec_capture().  Zero-initialize, set the
+ * options you need, and free out_buf/err_buf when done.
+ */
+struct exec_capture {
+	/* options */
+	/** optional file that receives a copy of stdout, opened with O_TRUNC */
+	const char *tee_file;
+	/** combined stdout+stderr bytes kept in memory, 0 for unlimited */
+	size_t max_bytes;
+	/** kill the child after this many milliseconds, 0 for no timeout */
+	int timeout_ms;
+	/** optional streaming callback, called in addition to buffering */
+	exec_output_cb callback;
+	void *callback_ctx;
+
+	/* results */
+	char *out_buf;
+	size_t out_len;
+	char *err_buf;
+	size_t err_len;
+	/** raw wait status of the child */
+	int status;
+	/** output beyond max_bytes was discarded */
+	bool truncated;
+	/** the child was killed because timeout_ms elapsed */
+	bool timed_out;
+};
+
+bool do_exec_capture(struct exec_capture *cap, int count, ...);
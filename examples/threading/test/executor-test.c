@@ -0,0 +1,238 @@
+/*
+ * executor-test.c
+ *
+ * Checks of mutex_executor: every task completes no earlier than its wait,
+ * the timer thread sleeps through long waits instead of waking every tick,
+ * tasks queued on a busy mutex do not poll it, a mutex held outside the
+ * executor is still obtained once released, and destroy drops pending tasks.
+ *
+ * Run with "make test" from the threading directory.
+ */
+
+#include "../threading.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if(!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while(0)
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_s(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* voluntary context switches of every thread of this process */
+static long context_switches(void)
+{
+    long total = 0;
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *de;
+    while(dir && (de = readdir(dir)) != NULL) {
+        if(de->d_name[0] == '.') {
+            continue;
+        }
+        char path[300], line[128];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/status", de->d_name);
+        FILE *f = fopen(path, "r");
+        long n;
+        while(f && fgets(line, sizeof(line), f)) {
+            if(sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1) {
+                total += n;
+            }
+        }
+        if(f) {
+            fclose(f);
+        }
+    }
+    if(dir) {
+        closedir(dir);
+    }
+    return total;
+}
+
+static struct thread_data *make_tasks(size_t n, pthread_mutex_t *mutex, int obtain_ms, int release_ms)
+{
+    struct thread_data *tasks = calloc(n, sizeof(*tasks));
+    for(size_t i = 0; tasks && i < n; i++) {
+        tasks[i].mutex = mutex;
+        tasks[i].wait_to_obtain_ms = obtain_ms;
+        tasks[i].wait_to_release_ms = release_ms;
+    }
+    return tasks;
+}
+
+static size_t completed(const struct thread_data *tasks, size_t n)
+{
+    size_t done = 0;
+    for(size_t i = 0; i < n; i++) {
+        done += tasks[i].thread_complete_success;
+    }
+    return done;
+}
+
+/* waits spread over every wheel level complete, and not before they are due */
+static void test_waits(void)
+{
+    static const int waits[] = { 0, 1, 5, 63, 64, 65, 200, 1000, 4095, 4096, 4200 };
+    const size_t n = sizeof(waits) / sizeof(waits[0]);
+    pthread_mutex_t mutex[sizeof(waits) / sizeof(waits[0])];
+    struct thread_data tasks[sizeof(waits) / sizeof(waits[0])];
+    struct mutex_executor *ex = mutex_executor_create(4);
+    CHECK(ex != NULL, "executor creation failed");
+    if(!ex) {
+        return;
+    }
+    memset(tasks, 0, sizeof(tasks));
+    double start = now_s();
+    for(size_t i = 0; i < n; i++) {
+        pthread_mutex_init(&mutex[i], NULL);
+        tasks[i].mutex = &mutex[i];
+        tasks[i].wait_to_obtain_ms = waits[i];
+        CHECK(mutex_executor_submit(ex, &tasks[i]), "submit failed");
+    }
+    // poll each task's completion against its wait
+    size_t done = 0;
+    bool seen[sizeof(waits) / sizeof(waits[0])] = { false };
+    while(done < n && now_s() - start < 10) {
+        for(size_t i = 0; i < n; i++) {
+            if(!seen[i] && tasks[i].thread_complete_success) {
+                double at = (now_s() - start) * 1000;
+                seen[i] = true;
+                done++;
+                CHECK(at >= waits[i] - 1, "task waiting %d ms completed after %.1f ms", waits[i], at);
+                CHECK(at <= waits[i] + 100, "task waiting %d ms completed late, after %.1f ms", waits[i], at);
+            }
+        }
+        usleep(500);
+    }
+    mutex_executor_wait(ex);
+    CHECK(completed(tasks, n) == n, "%zu of %zu tasks completed", completed(tasks, n), n);
+    mutex_executor_destroy(ex);
+}
+
+/* one long wait costs a handful of timer wakeups, not one per tick */
+static void test_idle_wakeups(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_data task = { .mutex = &mutex, .wait_to_obtain_ms = 1500 };
+    struct mutex_executor *ex = mutex_executor_create(1);
+    CHECK(ex != NULL, "executor creation failed");
+    if(!ex) {
+        return;
+    }
+    usleep(10000);
+    long before = context_switches();
+    CHECK(mutex_executor_submit(ex, &task), "submit failed");
+    mutex_executor_wait(ex);
+    long switches = context_switches() - before;
+    CHECK(task.thread_complete_success, "task did not complete");
+    CHECK(switches < 50, "%ld context switches for one 1500 ms wait", switches);
+    mutex_executor_destroy(ex);
+}
+
+/* tasks queued behind one mutex wait for its release instead of polling it */
+static void test_contention(void)
+{
+    const size_t n = 3000;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_data *tasks = make_tasks(n, &mutex, 0, 1);
+    struct mutex_executor *ex = mutex_executor_create(4);
+    CHECK(tasks && ex, "setup failed");
+    if(!tasks || !ex) {
+        free(tasks);
+        return;
+    }
+    double wall = now_s(), cpu = cpu_s();
+    for(size_t i = 0; i < n; i++) {
+        mutex_executor_submit(ex, &tasks[i]);
+    }
+    mutex_executor_wait(ex);
+    wall = now_s() - wall;
+    cpu = cpu_s() - cpu;
+    CHECK(completed(tasks, n) == n, "%zu of %zu tasks completed", completed(tasks, n), n);
+    // handing the mutex on costs a few us per task, polling it ~0.3 ms per task
+    CHECK(cpu < n * 50e-6, "%.2f s CPU for %zu contended tasks", cpu, n);
+    printf("contention: %zu tasks x 1 ms on one mutex, %.2f s wall, %.2f s CPU\n", n, wall, cpu);
+    mutex_executor_destroy(ex);
+    free(tasks);
+}
+
+/* a mutex held outside the executor is obtained once it is released */
+static void test_external_holder(void)
+{
+    const size_t n = 200;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_data *tasks = make_tasks(n, &mutex, 0, 0);
+    struct mutex_executor *ex = mutex_executor_create(4);
+    CHECK(tasks && ex, "setup failed");
+    if(!tasks || !ex) {
+        free(tasks);
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    for(size_t i = 0; i < n; i++) {
+        mutex_executor_submit(ex, &tasks[i]);
+    }
+    double cpu = cpu_s();
+    usleep(300000);
+    cpu = cpu_s() - cpu;
+    CHECK(completed(tasks, n) == 0, "tasks ran while the mutex was held");
+    CHECK(cpu < 0.1, "%.2f s CPU retrying a mutex held for 0.3 s", cpu);
+    pthread_mutex_unlock(&mutex);
+    mutex_executor_wait(ex);
+    CHECK(completed(tasks, n) == n, "%zu of %zu tasks completed", completed(tasks, n), n);
+    mutex_executor_destroy(ex);
+    free(tasks);
+}
+
+/* destroy drops tasks that are still waiting */
+static void test_destroy_pending(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_data task = { .mutex = &mutex, .wait_to_obtain_ms = 10000 };
+    struct mutex_executor *ex = mutex_executor_create(2);
+    CHECK(ex != NULL, "executor creation failed");
+    if(!ex) {
+        return;
+    }
+    CHECK(mutex_executor_submit(ex, &task), "submit failed");
+    double start = now_s();
+    mutex_executor_destroy(ex);
+    CHECK(now_s() - start < 1, "destroy waited for a pending task");
+    CHECK(!task.thread_complete_success, "pending task reported success");
+}
+
+int main(void)
+{
+    test_waits();
+    test_idle_wakeups();
+    test_contention();
+    test_external_holder();
+    test_destroy_pending();
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
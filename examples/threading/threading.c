@@ -2,6 +2,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
@@ -53,3 +57,397 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
 
     return true;
 }
+
+/*
+ * Hierarchical timer wheel with a 1ms tick: level 0 resolves the next 64ms,
+ * each further level covers 64 times the span of the one below and is
+ * cascaded down as the lower level wraps, as in the classic kernel timers.
+ * The timer thread sleeps until the next non-empty slot or cascade and skips
+ * the empty ticks in between.
+ *
+ * A task that finds its mutex taken by another task is parked on that mutex
+ * and handed to a worker when the holder releases it.  If the mutex is held
+ * outside the executor, one parked task at a time retries it each tick.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define WAITER_BUCKETS 64
+
+/* tasks parked on one mutex */
+struct mutex_waiters {
+    pthread_mutex_t *mutex;
+    /* an executor worker holds the mutex and will hand it on */
+    bool held;
+    /* the parked task retrying a mutex held outside the executor, if any */
+    struct thread_data *probe;
+    struct thread_data *head;
+    struct thread_data *tail;
+    struct mutex_waiters *next;
+};
+
+struct mutex_executor {
+    pthread_mutex_t lock;
+    pthread_cond_t timer_cond;
+    pthread_cond_t worker_cond;
+    pthread_cond_t idle_cond;
+    struct timespec start;
+    /* next tick the timer thread has to process */
+    unsigned long long tick;
+    struct thread_data *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    unsigned long timers_pending;
+    struct thread_data *ready_head;
+    struct thread_data *ready_tail;
+    /* submitted but not yet completed */
+    unsigned long outstanding;
+    struct mutex_waiters *waiters[WAITER_BUCKETS];
+    bool stop;
+    pthread_t timer_thread;
+    int num_workers;
+    pthread_t workers[];
+};
+
+static unsigned long long executor_now(struct mutex_executor *ex)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ex->start.tv_sec) * 1000ULL +
+        (now.tv_nsec - ex->start.tv_nsec) / 1000000LL;
+}
+
+static void executor_push_ready(struct mutex_executor *ex, struct thread_data *task)
+{
+    task->next = NULL;
+    if(ex->ready_tail) {
+        ex->ready_tail->next = task;
+    } else {
+        ex->ready_head = task;
+    }
+    ex->ready_tail = task;
+}
+
+/* Called with ex->lock held */
+static void executor_add_timer(struct mutex_executor *ex, struct thread_data *task)
+{
+    if(task->expires < ex->tick) {
+        executor_push_ready(ex, task);
+        pthread_cond_signal(&ex->worker_cond);
+        return;
+    }
+    unsigned long long delta = task->expires - ex->tick;
+    if(delta > WHEEL_MAX_DELTA) {
+        task->expires = ex->tick + WHEEL_MAX_DELTA;
+        delta = WHEEL_MAX_DELTA;
+    }
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (task->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    task->next = ex->wheel[level][slot];
+    ex->wheel[level][slot] = task;
+    ex->timers_pending++;
+}
+
+/* Re-file every timer of one higher level slot into the levels below it */
+static int executor_cascade(struct mutex_executor *ex, int level)
+{
+    int slot = (ex->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct thread_data *task = ex->wheel[level][slot];
+    ex->wheel[level][slot] = NULL;
+    while(task) {
+        struct thread_data *next = task->next;
+        ex->timers_pending--;
+        executor_add_timer(ex, task);
+        task = next;
+    }
+    return slot;
+}
+
+/* Process ex->tick and advance it, called with ex->lock held */
+static void executor_run_tick(struct mutex_executor *ex)
+{
+    int slot = ex->tick & WHEEL_MASK;
+    for(int level = 1; slot == 0 && level < WHEEL_LEVELS; level++) {
+        slot = executor_cascade(ex, level);
+    }
+    slot = ex->tick & WHEEL_MASK;
+    struct thread_data *task = ex->wheel[0][slot];
+    ex->wheel[0][slot] = NULL;
+    while(task) {
+        struct thread_data *next = task->next;
+        ex->timers_pending--;
+        executor_push_ready(ex, task);
+        pthread_cond_signal(&ex->worker_cond);
+        task = next;
+    }
+    ex->tick++;
+}
+
+/*
+ * First tick at or after ex->tick with work to do: a non-empty level 0 slot
+ * or the cascade of a non-empty higher level slot.  Called with ex->lock held.
+ * @return the tick, ULLONG_MAX if the wheel is empty
+ */
+static unsigned long long executor_next_expiry(struct mutex_executor *ex)
+{
+    unsigned long long next = ULLONG_MAX;
+    for(int i = 0; i < WHEEL_SIZE; i++) {
+        if(ex->wheel[0][(ex->tick + i) & WHEEL_MASK]) {
+            next = ex->tick + i;
+            break;
+        }
+    }
+    for(int level = 1; level < WHEEL_LEVELS; level++) {
+        //a level slot cascades on the first tick of its span
+        unsigned long long span = 1ULL << (WHEEL_BITS * level);
+        unsigned long long first = (ex->tick + span - 1) & ~(span - 1);
+        int slot = (first >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        for(int i = 0; i < WHEEL_SIZE && first + i * span < next; i++) {
+            if(ex->wheel[level][(slot + i) & WHEEL_MASK]) {
+                next = first + i * span;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void* executor_timer_func(void* arg)
+{
+    struct mutex_executor *ex = arg;
+    pthread_mutex_lock(&ex->lock);
+    while(!ex->stop) {
+        if(ex->timers_pending == 0) {
+            pthread_cond_wait(&ex->timer_cond, &ex->lock);
+            continue;
+        }
+        unsigned long long next = executor_next_expiry(ex);
+        if(next <= executor_now(ex)) {
+            //nothing is due on the ticks in between
+            ex->tick = next;
+            executor_run_tick(ex);
+            continue;
+        }
+        //sleep until the next expiry, a submit wakes us for an earlier one
+        struct timespec deadline = ex->start;
+        deadline.tv_sec += next / 1000;
+        deadline.tv_nsec += (next % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ex->timer_cond, &ex->lock, &deadline);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return NULL;
+}
+
+/* Find or create the waiters of @param mutex, NULL if out of memory; called with ex->lock held */
+static struct mutex_waiters *executor_waiters(struct mutex_executor *ex, pthread_mutex_t *mutex)
+{
+    struct mutex_waiters **bucket = &ex->waiters[((uintptr_t)mutex >> 4) % WAITER_BUCKETS];
+    for(struct mutex_waiters *w = *bucket; w; w = w->next) {
+        if(w->mutex == mutex) {
+            return w;
+        }
+    }
+    struct mutex_waiters *w = calloc(1, sizeof(*w));
+    if(w) {
+        w->mutex = mutex;
+        w->next = *bucket;
+        *bucket = w;
+    }
+    return w;
+}
+
+/* Retry @param task on the next tick, called with ex->lock held */
+static void executor_retry(struct mutex_executor *ex, struct thread_data *task)
+{
+    task->expires = executor_now(ex) + 1;
+    executor_add_timer(ex, task);
+    pthread_cond_signal(&ex->timer_cond);
+}
+
+/* @param task found its mutex busy, called with ex->lock held */
+static void executor_park(struct mutex_executor *ex, struct mutex_waiters *w, struct thread_data *task)
+{
+    task->next = NULL;
+    if(w->tail) {
+        w->tail->next = task;
+    } else {
+        w->head = task;
+    }
+    w->tail = task;
+    if(!w->held && !w->probe) {
+        //no worker will hand the mutex on, poll it with the oldest waiter
+        w->probe = w->head;
+        w->head = w->probe->next;
+        if(!w->head) {
+            w->tail = NULL;
+        }
+        executor_retry(ex, w->probe);
+    }
+}
+
+/* Release the mutex of @param w and hand it to the oldest waiter, called with ex->lock held */
+static void executor_release(struct mutex_executor *ex, struct mutex_waiters *w)
+{
+    pthread_mutex_unlock(w->mutex);
+    w->held = false;
+    struct thread_data *task = w->head;
+    if(task) {
+        w->head = task->next;
+        if(!w->head) {
+            w->tail = NULL;
+        }
+        executor_push_ready(ex, task);
+        pthread_cond_signal(&ex->worker_cond);
+    }
+}
+
+static void* executor_worker_func(void* arg)
+{
+    struct mutex_executor *ex = arg;
+    pthread_mutex_lock(&ex->lock);
+    while(!ex->stop) {
+        struct thread_data *task = ex->ready_head;
+        if(!task) {
+            pthread_cond_wait(&ex->worker_cond, &ex->lock);
+            continue;
+        }
+        ex->ready_head = task->next;
+        if(!ex->ready_head) {
+            ex->ready_tail = NULL;
+        }
+
+        //trylock under ex->lock, so parking and the holder's release cannot cross
+        struct mutex_waiters *w = executor_waiters(ex, task->mutex);
+        int rc = pthread_mutex_trylock(task->mutex);
+        if(w && w->probe == task) {
+            w->probe = NULL;
+        }
+        if(rc == EBUSY) {
+            if(w) {
+                executor_park(ex, w, task);
+            } else {
+                executor_retry(ex, task);
+            }
+            continue;
+        }
+        if(rc == 0) {
+            if(w) {
+                w->held = true;
+            }
+            pthread_mutex_unlock(&ex->lock);
+            usleep(task->wait_to_release_ms*1000);
+            pthread_mutex_lock(&ex->lock);
+            if(w) {
+                executor_release(ex, w);
+            } else {
+                pthread_mutex_unlock(task->mutex);
+            }
+            task->thread_complete_success = true;
+        } else {
+            ERROR_LOG("pthread_mutex_trylock failed with %d", rc);
+        }
+        if(--ex->outstanding == 0) {
+            pthread_cond_broadcast(&ex->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return NULL;
+}
+
+struct mutex_executor *mutex_executor_create(int num_workers)
+{
+    if(num_workers < 1) {
+        num_workers = 1;
+    }
+    struct mutex_executor *ex = calloc(1, sizeof(*ex) + num_workers * sizeof(pthread_t));
+    if(!ex) {
+        ERROR_LOG("Error while allocating memory for mutex_executor");
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ex->start);
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->worker_cond, NULL);
+    pthread_cond_init(&ex->idle_cond, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ex->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&ex->timer_thread, NULL, executor_timer_func, ex) != 0) {
+        ERROR_LOG("Error : pthread_create for timer thread");
+        free(ex);
+        return NULL;
+    }
+    for(ex->num_workers = 0; ex->num_workers < num_workers; ex->num_workers++) {
+        if(pthread_create(&ex->workers[ex->num_workers], NULL, executor_worker_func, ex) != 0) {
+            ERROR_LOG("Error : pthread_create for worker %d", ex->num_workers);
+            mutex_executor_destroy(ex);
+            return NULL;
+        }
+    }
+    return ex;
+}
+
+bool mutex_executor_submit(struct mutex_executor *ex, struct thread_data *data)
+{
+    data->thread_complete_success = false;
+    pthread_mutex_lock(&ex->lock);
+    if(ex->stop) {
+        pthread_mutex_unlock(&ex->lock);
+        return false;
+    }
+    unsigned long long now = executor_now(ex);
+    if(ex->timers_pending == 0 && ex->tick < now) {
+        //wheel is empty, skip the idle ticks
+        ex->tick = now;
+    }
+    data->expires = now + (data->wait_to_obtain_ms > 0 ? data->wait_to_obtain_ms : 0);
+    ex->outstanding++;
+    executor_add_timer(ex, data);
+    pthread_cond_signal(&ex->timer_cond);
+    pthread_mutex_unlock(&ex->lock);
+    return true;
+}
+
+void mutex_executor_wait(struct mutex_executor *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    while(ex->outstanding > 0) {
+        pthread_cond_wait(&ex->idle_cond, &ex->lock);
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+void mutex_executor_destroy(struct mutex_executor *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = true;
+    pthread_cond_broadcast(&ex->timer_cond);
+    pthread_cond_broadcast(&ex->worker_cond);
+    pthread_mutex_unlock(&ex->lock);
+
+    pthread_join(ex->timer_thread, NULL);
+    for(int i = 0; i < ex->num_workers; i++) {
+        pthread_join(ex->workers[i], NULL);
+    }
+    pthread_cond_destroy(&ex->timer_cond);
+    pthread_cond_destroy(&ex->worker_cond);
+    pthread_cond_destroy(&ex->idle_cond);
+    pthread_mutex_destroy(&ex->lock);
+    for(int i = 0; i < WAITER_BUCKETS; i++) {
+        while(ex->waiters[i]) {
+            struct mutex_waiters *w = ex->waiters[i];
+            ex->waiters[i] = w->next;
+            free(w);
+        }
+    }
+    free(ex);
+}
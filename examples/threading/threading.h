@@ -23,6 +23,12 @@ struct thread_data{
      * if an error occurred.
      */
     bool thread_complete_success;
+    /*
+     * Used only by struct mutex_executor: intrusive link for the timer wheel
+     * and ready queue, and the tick the task is due at.
+     */
+    struct thread_data *next;
+    unsigned long long expires;
 };
 
 
@@ -41,3 +47,39 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * A pool of worker threads driven by a hierarchical timer wheel, used to run many
+ * wait/obtain/hold/release sequences without creating a thread for each one.
+ */
+struct mutex_executor;
+
+/**
+* Create an executor with @param num_workers worker threads plus one timer thread.
+* @return the executor, or NULL if memory or threads could not be allocated.
+*/
+struct mutex_executor *mutex_executor_create(int num_workers);
+
+/**
+* Schedule the sequence described by @param data: after data->wait_to_obtain_ms the mutex
+* in data->mutex is obtained, held for data->wait_to_release_ms and released, then
+* data->thread_complete_success is set to true.  @param data is owned by the caller and
+* must stay valid until mutex_executor_wait() returns; data->thread is not used.
+* Pending tasks only cost their thread_data, so tens of thousands can be queued.
+* A worker is occupied only while the mutex is held; a task finding the mutex held by
+* another task waits without a worker until that task releases it, and one held outside
+* the executor is retried each timer tick by one of the tasks waiting for it.
+* @return true if the task was scheduled, false if the executor is shutting down.
+*/
+bool mutex_executor_submit(struct mutex_executor *executor, struct thread_data *data);
+
+/**
+* Block until every task submitted so far has completed.
+*/
+void mutex_executor_wait(struct mutex_executor *executor);
+
+/**
+* Stop and join all executor threads and free the executor.  Tasks still pending are
+* dropped with thread_complete_success left false.
+*/
+void mutex_executor_destroy(struct mutex_executor *executor);
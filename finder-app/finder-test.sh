@@ -54,13 +54,20 @@ fi
 #make clean
 #make
 
+# write all files from one writer process in batch mode
 for i in $( seq 1 $NUMFILES)
 do
 	#./writer.sh "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-	./writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | ./writer -b
 
-OUTPUTSTRING=$(./finder.sh "$WRITEDIR" "$WRITESTR")
+# prefer the native single-pass finder when it has been built
+if [ -x ./finder ]
+then
+	OUTPUTSTRING=$(./finder "$WRITEDIR" "$WRITESTR")
+else
+	OUTPUTSTRING=$(./finder.sh "$WRITEDIR" "$WRITESTR")
+fi
 echo "$OUTPUTSTRING" > "$OUTPUT_FILE"
 
 # remove temporary directories
@@ -0,0 +1,327 @@
+/*
+ * Native replacement for finder.sh: counts the regular files below a
+ * directory and the lines in them matching a search string, printing the
+ * same line as
+ *
+ *   find "$filesdir" -type f | wc -l
+ *   grep -r "$searchstr" "$filesdir" | wc -l
+ *
+ * but in a single multithreaded walk.  Files are mmap()ed and searched with
+ * a SIMD first/last byte filter.  Search strings containing basic regular
+ * expression characters fall back to regexec() so results still match grep.
+ * As with GNU grep 3.5+, which reports "binary file matches" on stderr, files
+ * containing NUL bytes add no lines to the count.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAX_THREADS 16
+
+/* shared stack of directories still to be read */
+struct dir_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **paths;
+    size_t len;
+    size_t cap;
+    int busy;
+};
+
+struct search {
+    const char *needle;
+    size_t needle_len;
+    bool use_regex;
+    regex_t regex;
+};
+
+struct worker {
+    pthread_t thread;
+    struct dir_queue *queue;
+    const struct search *search;
+    unsigned long files;
+    unsigned long lines;
+};
+
+static void queue_push(struct dir_queue *q, char *path)
+{
+    pthread_mutex_lock(&q->lock);
+    if(q->len == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        char **paths = realloc(q->paths, cap * sizeof(*paths));
+        if(!paths) {
+            pthread_mutex_unlock(&q->lock);
+            fprintf(stderr, "finder: out of memory, skipping %s\n", path);
+            free(path);
+            return;
+        }
+        q->paths = paths;
+        q->cap = cap;
+    }
+    q->paths[q->len++] = path;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Returns the next directory, or NULL once the queue is empty and no worker can add more */
+static char *queue_pop(struct dir_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->len == 0 && q->busy > 0) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    char *path = NULL;
+    if(q->len > 0) {
+        path = q->paths[--q->len];
+        q->busy++;
+    } else {
+        // nothing left anywhere, release the other waiters
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+static void queue_done(struct dir_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    if(--q->busy == 0 && q->len == 0) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Find @param needle in @param hay, like memmem() */
+static const char *find_substr(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+    if(needle_len == 1) {
+        return memchr(hay, needle[0], len);
+    }
+    if(len < needle_len) {
+        return NULL;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    // compare the first and last needle byte at 16 offsets at once, verify candidates
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for(; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                    _mm_cmpeq_epi8(b, last)));
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            if(memcmp(hay + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, len - i, needle, needle_len);
+}
+
+static unsigned long count_literal(const char *data, size_t size, const struct search *s)
+{
+    unsigned long lines = 0;
+    const char *p = data, *end = data + size;
+    while(p < end) {
+        const char *hit = s->needle_len ? find_substr(p, end - p, s->needle, s->needle_len) : p;
+        if(!hit) {
+            break;
+        }
+        lines++;
+        const char *eol = memchr(hit, '\n', end - hit);
+        if(!eol) {
+            break;
+        }
+        p = eol + 1;
+    }
+    return lines;
+}
+
+static unsigned long count_regex(const char *data, size_t size, const struct search *s)
+{
+    unsigned long lines = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    const char *p = data, *end = data + size;
+    while(p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t len = (eol ? eol : end) - p;
+        if(len + 1 > line_cap) {
+            line_cap = len + 1;
+            char *grown = realloc(line, line_cap);
+            if(!grown) {
+                break;
+            }
+            line = grown;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        if(regexec(&s->regex, line, 0, NULL, 0) == 0) {
+            lines++;
+        }
+        if(!eol) {
+            break;
+        }
+        p = eol + 1;
+    }
+    free(line);
+    return lines;
+}
+
+static void scan_file(struct worker *w, int dir_fd, const char *name)
+{
+    w->files++;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if(fd < 0) {
+        return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    unsigned long lines = w->search->use_regex ?
+        count_regex(data, st.st_size, w->search) :
+        count_literal(data, st.st_size, w->search);
+    if(lines > 0 && memchr(data, '\0', st.st_size)) {
+        lines = 0;
+    }
+    w->lines += lines;
+    munmap(data, st.st_size);
+}
+
+static void scan_dir(struct worker *w, const char *path)
+{
+    DIR *dir = opendir(path);
+    if(!dir) {
+        return;
+    }
+    int dir_fd = dirfd(dir);
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if(type == DT_UNKNOWN) {
+            struct stat st;
+            if(fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if(type == DT_REG) {
+            scan_file(w, dir_fd, name);
+        } else if(type == DT_DIR) {
+            char *child;
+            if(asprintf(&child, "%s/%s", path, name) >= 0) {
+                queue_push(w->queue, child);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static void *worker_func(void *arg)
+{
+    struct worker *w = arg;
+    char *path;
+    while((path = queue_pop(w->queue)) != NULL) {
+        scan_dir(w, path);
+        free(path);
+        queue_done(w->queue);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 3) {
+        printf(" Usage %s <filesdir> <searchstring> \n", argv[0]);
+        return 1;
+    }
+    const char *filesdir = argv[1];
+    struct stat st;
+    if(stat(filesdir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        printf(" %s directory does not exists\n", filesdir);
+        return 1;
+    }
+
+    struct search search = {
+        .needle = argv[2],
+        .needle_len = strlen(argv[2]),
+        .use_regex = strpbrk(argv[2], "\\.[]*^$") != NULL,
+    };
+    if(search.use_regex && regcomp(&search.regex, search.needle, REG_NOSUB) != 0) {
+        fprintf(stderr, "finder: invalid search pattern %s\n", search.needle);
+        return 2;
+    }
+
+    struct dir_queue queue = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    char *root = strdup(filesdir);
+    if(!root) {
+        return 1;
+    }
+    queue_push(&queue, root);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+    struct worker workers[MAX_THREADS];
+    int started = 0;
+    for(int i = 0; i < num_workers; i++) {
+        workers[i] = (struct worker){ .queue = &queue, .search = &search };
+        if(pthread_create(&workers[i].thread, NULL, worker_func, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if(started == 0) {
+        workers[0] = (struct worker){ .queue = &queue, .search = &search };
+        worker_func(&workers[0]);
+        started = 1;
+    } else {
+        for(int i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    unsigned long files = 0, lines = 0;
+    for(int i = 0; i < started; i++) {
+        files += workers[i].files;
+        lines += workers[i].lines;
+    }
+    printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+
+    free(queue.paths);
+    if(search.use_regex) {
+        regfree(&search.regex);
+    }
+    return 0;
+}
@@ -144,6 +144,8 @@ make clean
 make CROSS_COMPILE=aarch64-none-linux-gnu-
 cp ./writer ${OUTDIR}/rootfs/home
 echo "copied writer to ${OUTDIR}/rootfs/home"
+cp ./finder ${OUTDIR}/rootfs/home
+echo "copied finder to ${OUTDIR}/rootfs/home"
 
 # TODO: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
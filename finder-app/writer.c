@@ -1,18 +1,298 @@
+#define _GNU_SOURCE     /* fallocate */
 #include <fcntl.h>      /* open flags */
 #include <unistd.h>     /* write, close */
 #include <sys/stat.h>   /* mode constants */
 #include <string.h>     /* strerror */
 #include <errno.h>      /* errno */
 #include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_JOBS 64
+/* claim this many manifest entries at a time from the shared cursor */
+#define BATCH_CHUNK 64
+/* below one block there is nothing for fallocate to lay out */
+#define FALLOCATE_MIN 4096
+
+struct entry {
+    const char *path;
+    const char *content;
+    size_t len;
+};
+
+struct batch {
+    struct entry *entries;
+    size_t count;
+    size_t next;            /* shared cursor, atomic */
+    unsigned long failed;   /* atomic */
+};
+
+/* write all of buf to fd, 0 on success */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* open (create/truncate) and fill one file, 0 on success */
+static int write_file(int dir_fd, const char *name, const char *path,
+                      const char *content, size_t len)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Error, unable to open/create file %s : %s", path, strerror(errno));
+        return -1;
+    }
+    /* best effort, EOPNOTSUPP on some filesystems */
+    if (len >= FALLOCATE_MIN)
+        fallocate(fd, 0, 0, len);
+    if (write_all(fd, content, len) < 0) {
+        syslog(LOG_ERR, "Error writing to file %s : %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Worker for batch mode.  Each worker keeps the fd of the directory it last
+ * wrote into, so consecutive files in one directory only cost an openat()
+ * relative to it instead of a full path walk.
+ */
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    int dir_fd = -1;
+    const char *dir = NULL;
+    size_t dir_len = 0;
+    char dir_buf[4096];
+
+    for (;;) {
+        size_t start = __atomic_fetch_add(&b->next, BATCH_CHUNK, __ATOMIC_RELAXED);
+        if (start >= b->count)
+            break;
+        size_t end = start + BATCH_CHUNK < b->count ? start + BATCH_CHUNK : b->count;
+
+        for (size_t i = start; i < end; i++) {
+            struct entry *e = &b->entries[i];
+            const char *slash = strrchr(e->path, '/');
+            const char *name, *this_dir;
+            size_t len;
+            if (!slash) {
+                this_dir = ".";
+                len = 1;
+                name = e->path;
+            } else if (slash == e->path) {
+                this_dir = "/";
+                len = 1;
+                name = slash + 1;
+            } else {
+                this_dir = e->path;
+                len = slash - e->path;
+                name = slash + 1;
+            }
+
+            if (dir_fd < 0 || len != dir_len || memcmp(dir, this_dir, len) != 0) {
+                if (dir_fd >= 0)
+                    close(dir_fd);
+                dir_fd = -1;
+                if (len >= sizeof(dir_buf)) {
+                    syslog(LOG_ERR, "Error, path too long %s", e->path);
+                    __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                memcpy(dir_buf, this_dir, len);
+                dir_buf[len] = '\0';
+                dir_fd = open(dir_buf, O_PATH | O_DIRECTORY | O_CLOEXEC);
+                if (dir_fd < 0) {
+                    syslog(LOG_ERR, "Error, unable to open directory %s : %s", dir_buf, strerror(errno));
+                    __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                dir = this_dir;
+                dir_len = len;
+            }
+            if (write_file(dir_fd, name, e->path, e->content, e->len) < 0)
+                __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (dir_fd >= 0)
+        close(dir_fd);
+    return NULL;
+}
+
+/* read all of fd into a NUL terminated buffer */
+static char *read_all(int fd, size_t *len)
+{
+    size_t cap = 65536, used = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        if (used + 1 >= cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
+                break;
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + used, cap - used - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        if (n == 0) {
+            buf[used] = '\0';
+            *len = used;
+            return buf;
+        }
+        used += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Batch mode: the manifest holds one "path<TAB>content" pair per line.  As in
+ * the single file mode the content is written without a trailing newline.
+ */
+static int run_batch(const char *manifest, int jobs, bool stats)
+{
+    int fd = manifest ? open(manifest, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd < 0) {
+        syslog(LOG_ERR, "Error, unable to open manifest %s : %s", manifest, strerror(errno));
+        return 1;
+    }
+    size_t size = 0;
+    char *data = read_all(fd, &size);
+    if (manifest)
+        close(fd);
+    if (!data) {
+        syslog(LOG_ERR, "Error reading manifest : %s", strerror(errno));
+        return 1;
+    }
+
+    size_t cap = 1024;
+    struct batch b = { .entries = malloc(cap * sizeof(struct entry)) };
+    unsigned long bad_lines = 0;
+    for (char *line = data; b.entries && line < data + size; ) {
+        char *eol = memchr(line, '\n', data + size - line);
+        if (eol)
+            *eol = '\0';
+        char *next = eol ? eol + 1 : data + size;
+        if (*line != '\0') {
+            char *tab = strchr(line, '\t');
+            if (!tab || tab == line) {
+                syslog(LOG_ERR, "Malformed manifest line: %s", line);
+                bad_lines++;
+            } else {
+                if (b.count == cap) {
+                    struct entry *grown = realloc(b.entries, cap * 2 * sizeof(struct entry));
+                    if (!grown) {
+                        syslog(LOG_ERR, "Error allocating manifest entries");
+                        bad_lines++;
+                        break;
+                    }
+                    b.entries = grown;
+                    cap *= 2;
+                }
+                *tab = '\0';
+                b.entries[b.count++] = (struct entry){ line, tab + 1, strlen(tab + 1) };
+            }
+        }
+        line = next;
+    }
+    if (!b.entries) {
+        syslog(LOG_ERR, "Error allocating manifest entries");
+        free(data);
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0)
+            break;
+        started++;
+    }
+    batch_worker(&b);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (stats) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        unsigned long long bytes = 0;
+        for (size_t i = 0; i < b.count; i++)
+            bytes += b.entries[i].len;
+        printf("wrote %zu files (%llu bytes) with %d thread(s) in %.3f s: %.0f files/s, %.2f MB/s\n",
+               b.count - b.failed, bytes, started + 1, secs,
+               secs > 0 ? (b.count - b.failed) / secs : 0.0,
+               secs > 0 ? bytes / secs / 1e6 : 0.0);
+    }
+
+    int rc = (b.failed || bad_lines) ? 1 : 0;
+    free(b.entries);
+    free(data);
+    return rc;
+}
+
+static int usage(void)
+{
+    syslog(LOG_ERR, "Pass filepath and string to be written, or -b [-f manifest] [-j jobs] [-s]");
+    closelog();
+    return 1;
+}
 
 int main(int argc, char* argv[]) {
     /* open syslog connection */
     openlog("writer_log", LOG_PID, LOG_USER);
 
-    if (argc != 3) {
-        syslog(LOG_ERR, "Pass filepath and string to be written");
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+        const char *manifest = NULL;
+        int jobs = 1;
+        bool stats = false;
+        int opt;
+        optind = 2;
+        while ((opt = getopt(argc, argv, "f:j:s")) != -1) {
+            switch (opt) {
+            case 'f':
+                manifest = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1 || jobs > MAX_JOBS)
+                    return usage();
+                break;
+            case 's':
+                stats = true;
+                break;
+            default:
+                return usage();
+            }
+        }
+        if (optind != argc)
+            return usage();
+        int rc = run_batch(manifest, jobs, stats);
         closelog();
-        return 1;
+        return rc;
+    }
+
+    if (argc != 3) {
+        return usage();
     }
 
     const char* writepath = argv[1];
@@ -39,4 +319,3 @@ int main(int argc, char* argv[]) {
     closelog();
     return 0;
 }
-
@@ -0,0 +1,110 @@
+/*
+ * aesdpool.c
+ *
+ * Fixed size object pools, see aesdpool.h.
+ */
+
+#include "aesdpool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SLAB_MIN_ALIGN 16
+
+int slab_init(struct slab *slab, const char *name, size_t obj_size, size_t count, int flags)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    memset(slab, 0, sizeof(*slab));
+    slab->name = name;
+    if(flags & SLAB_STACK) {
+        slab->obj_size = (obj_size + page - 1) & ~(page - 1);
+        slab->stride = slab->obj_size + page;
+    } else {
+        // room for the free list link, aligned for any object
+        if(obj_size < sizeof(void *)) {
+            obj_size = sizeof(void *);
+        }
+        slab->obj_size = (obj_size + SLAB_MIN_ALIGN - 1) & ~(size_t)(SLAB_MIN_ALIGN - 1);
+        slab->stride = slab->obj_size;
+    }
+    slab->count = count;
+    slab->mem_size = slab->stride * count;
+    // populate now so the budget is committed at startup, not on first use
+    slab->mem = mmap(NULL, slab->mem_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(slab->mem == MAP_FAILED) {
+        syslog(LOG_ERR, "mmap error for %s pool of %zu bytes : %s", name, slab->mem_size, strerror(errno));
+        slab->mem = NULL;
+        return -1;
+    }
+    // build the free list back to front so objects are handed out in address order
+    for(size_t i = count; i-- > 0; ) {
+        char *base = slab->mem + i * slab->stride;
+        char *obj = base;
+        if(flags & SLAB_STACK) {
+            // stacks grow down into the guard page at the start of the stride
+            if(mprotect(base, page, PROT_NONE) < 0) {
+                syslog(LOG_ERR, "mprotect error for %s pool : %s", name, strerror(errno));
+                munmap(slab->mem, slab->mem_size);
+                slab->mem = NULL;
+                return -1;
+            }
+            obj = base + page;
+        }
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    pthread_mutex_init(&slab->lock, NULL);
+    return 0;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+    pthread_mutex_lock(&slab->lock);
+    void *obj = slab->free_list;
+    if(obj) {
+        slab->free_list = *(void **)obj;
+        if(++slab->in_use > slab->peak) {
+            slab->peak = slab->in_use;
+        }
+    } else {
+        slab->rejected++;
+    }
+    pthread_mutex_unlock(&slab->lock);
+    return obj;
+}
+
+void slab_free(struct slab *slab, void *obj)
+{
+    if(obj == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&slab->lock);
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_report(struct slab *slab)
+{
+    pthread_mutex_lock(&slab->lock);
+    syslog(LOG_INFO, "pool %s: %zu/%zu in use, peak %zu, rejected %lu, %zu bytes of %zu reserved",
+            slab->name, slab->in_use, slab->count, slab->peak, slab->rejected,
+            slab->peak * slab->stride, slab->mem_size);
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_destroy(struct slab *slab)
+{
+    if(slab->mem == NULL) {
+        return;
+    }
+    munmap(slab->mem, slab->mem_size);
+    pthread_mutex_destroy(&slab->lock);
+    slab->mem = NULL;
+    slab->free_list = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ * aesdpool.h
+ *
+ * Fixed size object pools for aesdsocket's memory budget mode (-m).
+ *
+ * A slab is one anonymous mapping, populated at startup, cut into count
+ * objects of one size.  slab_alloc() never grows it: once every object is in
+ * use it fails and counts a rejection, so the daemon's footprint is fixed by
+ * its command line.  SLAB_STACK objects are page aligned with a PROT_NONE
+ * guard page below each one, for use with pthread_attr_setstack().
+ */
+
+#ifndef AESDPOOL_H
+#define AESDPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_STACK 0x1
+
+struct slab {
+    pthread_mutex_t lock;
+    const char *name;
+    /* usable bytes per object */
+    size_t obj_size;
+    /* distance between objects, guard page included */
+    size_t stride;
+    size_t count;
+    char *mem;
+    size_t mem_size;
+    void *free_list;
+    size_t in_use;
+    size_t peak;
+    unsigned long rejected;
+};
+
+/**
+ * Map and populate @param count objects of @param obj_size bytes.
+ * @param flags 0 or SLAB_STACK
+ * @return 0 on success, -1 on error (logged to syslog)
+ */
+int slab_init(struct slab *slab, const char *name, size_t obj_size, size_t count, int flags);
+
+/**
+ * Take a free object.
+ * @return the object, or NULL when the slab is exhausted
+ */
+void *slab_alloc(struct slab *slab);
+
+/**
+ * Return @param obj to the slab, NULL is ignored.
+ */
+void slab_free(struct slab *slab, void *obj);
+
+/**
+ * Log usage, peak usage and rejections of the slab to syslog.
+ */
+void slab_report(struct slab *slab);
+
+/**
+ * Unmap the slab, every object must have been freed.
+ */
+void slab_destroy(struct slab *slab);
+
+#endif /* AESDPOOL_H */
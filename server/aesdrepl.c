@@ -0,0 +1,474 @@
+/*
+ * aesdrepl.c
+ *
+ * Primary and follower sides of aesdsocket replication, see aesdrepl.h.
+ */
+
+#include "aesdrepl.h"
+#include "lockprof.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_REPL_CHANNELS 16
+#define REPL_POLL_MS 200
+#define REPL_RETRY_MS 1000
+
+/* primary side, one per connected follower stream */
+struct repl_peer {
+    int used;
+    int finished;
+    int fd;
+    int channel;
+    pthread_t thread;
+    /* copy buffer for store_send_raw(), NULL without a buffer slab */
+    char *buf;
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t primary_size;
+};
+
+/* follower side, one per channel */
+struct repl_follower {
+    int channel;
+    int fd;
+    int connected;
+    pthread_t thread;
+    uint64_t replicated;
+    uint64_t primary_size;
+};
+
+static struct aesd_store *repl_stores;
+static int repl_channels;
+static volatile sig_atomic_t *repl_stop;
+/* stack size for replication threads, NULL for the default */
+static const pthread_attr_t *repl_attr;
+/* preallocated copy buffers in budget mode, NULL to use the heap */
+static struct slab *repl_buffers;
+/* identifies this primary instance, a follower holding data from another resyncs from 0 */
+static uint64_t repl_epoch;
+
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct repl_peer peers[REPL_MAX_PEERS];
+static struct repl_follower followers[MAX_REPL_CHANNELS];
+static int num_followers = 0;
+static char *follow_endpoint;
+
+static int send_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_fully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while(len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sleep @param ms in short steps so shutdown is not delayed */
+static void repl_sleep(int ms)
+{
+    struct timespec step = {0, 100 * 1000000L};
+    for(int slept = 0; slept < ms && !*repl_stop; slept += 100) {
+        nanosleep(&step, NULL);
+    }
+}
+
+void repl_init(struct aesd_store *stores, int num_channels, volatile sig_atomic_t *stop,
+        const pthread_attr_t *attr, struct slab *buffers)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    repl_stores = stores;
+    repl_channels = num_channels;
+    repl_stop = stop;
+    repl_attr = attr;
+    repl_buffers = buffers;
+    repl_epoch = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Give back a replication buffer, to its slab in budget mode */
+static void repl_buffer_free(char *buf)
+{
+    if(repl_buffers) {
+        slab_free(repl_buffers, buf);
+    } else {
+        free(buf);
+    }
+}
+
+static void *sender_thread(void *arg)
+{
+    struct repl_peer *peer = arg;
+    struct repl_hello hello;
+    if(recv_fully(peer->fd, &hello, sizeof(hello)) < 0 || hello.magic != REPL_MAGIC ||
+            hello.channel >= (uint32_t)repl_channels) {
+        syslog(LOG_ERR, "replication: rejecting follower with a bad hello");
+        goto out;
+    }
+    struct aesd_store *store = &repl_stores[hello.channel];
+    uint64_t size = store_wait_size(store, UINT64_MAX, 0);
+    // data from another primary instance, or more than we have, cannot be continued
+    uint64_t start = (hello.epoch == repl_epoch && hello.offset <= size) ? hello.offset : 0;
+    struct repl_welcome welcome = {
+        .magic = REPL_MAGIC,
+        .format = store->format,
+        .epoch = repl_epoch,
+        .start = start,
+    };
+    if(send_fully(peer->fd, &welcome, sizeof(welcome)) < 0) {
+        goto out;
+    }
+    syslog(LOG_INFO, "replication: follower joined channel %u at offset %llu",
+            hello.channel, (unsigned long long)start);
+
+    PROF_MUTEX_LOCK(&repl_lock);
+    peer->channel = hello.channel;
+    peer->sent = peer->acked = start;
+    PROF_MUTEX_UNLOCK(&repl_lock);
+
+    uint64_t sent = start;
+    uint64_t ack = 0;
+    size_t ack_have = 0;
+    while(!*repl_stop) {
+        size = store_wait_size(store, sent, REPL_POLL_MS);
+        if(size > sent) {
+            // the whole new range in one frame so it ends on a record boundary
+            struct repl_frame frame = {
+                .offset = sent,
+                .length = size - sent,
+                .primary_size = size,
+            };
+            if(send_fully(peer->fd, &frame, sizeof(frame)) < 0 ||
+                    store_send_raw(store, peer->fd, sent, size, peer->buf) < 0) {
+                syslog(LOG_ERR, "replication: follower on channel %d lost : %s",
+                        peer->channel, strerror(errno));
+                break;
+            }
+            sent = size;
+        }
+        // collect acknowledgements without blocking the stream
+        ssize_t n;
+        while((n = recv(peer->fd, (char *)&ack + ack_have, sizeof(ack) - ack_have, MSG_DONTWAIT)) > 0) {
+            ack_have += n;
+            if(ack_have == sizeof(ack)) {
+                ack_have = 0;
+                PROF_MUTEX_LOCK(&repl_lock);
+                peer->acked = ack;
+                PROF_MUTEX_UNLOCK(&repl_lock);
+            }
+        }
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            syslog(LOG_INFO, "replication: follower on channel %d disconnected", peer->channel);
+            break;
+        }
+        PROF_MUTEX_LOCK(&repl_lock);
+        peer->sent = sent;
+        peer->primary_size = size;
+        PROF_MUTEX_UNLOCK(&repl_lock);
+    }
+
+out:
+    PROF_MUTEX_LOCK(&repl_lock);
+    close(peer->fd);
+    peer->fd = -1;
+    peer->finished = 1;
+    PROF_MUTEX_UNLOCK(&repl_lock);
+    return NULL;
+}
+
+int repl_serve_follower(int fd)
+{
+    struct repl_peer *slot = NULL;
+    PROF_MUTEX_LOCK(&repl_lock);
+    for(int i = 0; i < REPL_MAX_PEERS; i++) {
+        struct repl_peer *peer = &peers[i];
+        if(peer->used && peer->finished) {
+            // reap the stream that used this slot before
+            pthread_join(peer->thread, NULL);
+            repl_buffer_free(peer->buf);
+            peer->used = 0;
+        }
+        if(!peer->used && slot == NULL) {
+            slot = peer;
+        }
+    }
+    if(!slot) {
+        syslog(LOG_ERR, "replication: too many followers, rejecting");
+    } else {
+        memset(slot, 0, sizeof(*slot));
+        // without a slab the stream only allocates if sendfile() is unavailable
+        if(repl_buffers && (slot->buf = slab_alloc(repl_buffers)) == NULL) {
+            syslog(LOG_ERR, "replication: no buffer left for another follower, rejecting");
+            slot = NULL;
+        }
+    }
+    if(slot) {
+        slot->used = 1;
+        slot->fd = fd;
+        slot->channel = -1;
+        if(pthread_create(&slot->thread, repl_attr, sender_thread, slot) != 0) {
+            syslog(LOG_ERR, "replication: thread creation failed %s", strerror(errno));
+            repl_buffer_free(slot->buf);
+            slot->used = 0;
+            slot = NULL;
+        }
+    }
+    PROF_MUTEX_UNLOCK(&repl_lock);
+    if(!slot) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Connect to a Unix socket path or a local TCP port */
+static int repl_connect(const char *endpoint)
+{
+    int fd;
+    if(strchr(endpoint, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, endpoint, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    struct addrinfo hints, *res, *resptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("localhost", endpoint, &hints, &res) != 0) {
+        return -1;
+    }
+    fd = -1;
+    for(resptr = res; resptr != NULL; resptr = resptr->ai_next) {
+        fd = socket(resptr->ai_family, resptr->ai_socktype | SOCK_CLOEXEC, resptr->ai_protocol);
+        if(fd == -1) continue;
+        if(connect(fd, resptr->ai_addr, resptr->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Receive frames until the connection breaks, returns when a reconnect is needed.
+ * @param buf holds STORE_SEND_CHUNK bytes, kept off the thread stack for budget mode.
+ */
+static void follow_stream(struct repl_follower *f, struct aesd_store *store, int fd, uint64_t *epoch,
+        char *buf)
+{
+    struct repl_hello hello = {
+        .magic = REPL_MAGIC,
+        .channel = f->channel,
+        .epoch = *epoch,
+        .offset = store_wait_size(store, UINT64_MAX, 0),
+    };
+    // drop whatever a broken frame left past the committed size
+    if(store_truncate(store, hello.offset) < 0) {
+        return;
+    }
+    struct repl_welcome welcome;
+    if(send_fully(fd, &hello, sizeof(hello)) < 0 || recv_fully(fd, &welcome, sizeof(welcome)) < 0) {
+        return;
+    }
+    if(welcome.magic != REPL_MAGIC || welcome.format != (uint32_t)store->format) {
+        syslog(LOG_ERR, "replication: primary store format does not match channel %d, use the same -r setting",
+                f->channel);
+        repl_sleep(10 * REPL_RETRY_MS);
+        return;
+    }
+    *epoch = welcome.epoch;
+    if(welcome.start != hello.offset) {
+        syslog(LOG_INFO, "replication: channel %d resyncing from offset %llu",
+                f->channel, (unsigned long long)welcome.start);
+        if(store_truncate(store, welcome.start) < 0) {
+            return;
+        }
+    }
+    uint64_t local = welcome.start;
+    while(!*repl_stop) {
+        struct repl_frame frame;
+        if(recv_fully(fd, &frame, sizeof(frame)) < 0) {
+            return;
+        }
+        if(frame.offset != local) {
+            syslog(LOG_ERR, "replication: channel %d expected offset %llu, got %llu",
+                    f->channel, (unsigned long long)local, (unsigned long long)frame.offset);
+            return;
+        }
+        uint64_t left = frame.length;
+        while(left > 0) {
+            size_t want = left < STORE_SEND_CHUNK ? left : STORE_SEND_CHUNK;
+            ssize_t n = recv(fd, buf, want, 0);
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0 || store_write_raw(store, buf, n) < 0) {
+                // bytes past the committed size are dropped on reconnect
+                return;
+            }
+            left -= n;
+        }
+        if(store_commit(store) < 0) {
+            return;
+        }
+        local += frame.length;
+        if(send_fully(fd, &local, sizeof(local)) < 0) {
+            return;
+        }
+        PROF_MUTEX_LOCK(&repl_lock);
+        f->replicated = local;
+        f->primary_size = frame.primary_size;
+        PROF_MUTEX_UNLOCK(&repl_lock);
+    }
+}
+
+static void *follower_thread(void *arg)
+{
+    struct repl_follower *f = arg;
+    struct aesd_store *store = &repl_stores[f->channel];
+    uint64_t epoch = 0;
+    char *buf = repl_buffers ? slab_alloc(repl_buffers) : malloc(STORE_SEND_CHUNK);
+    if(!buf) {
+        syslog(LOG_ERR, "replication: no buffer for channel %d", f->channel);
+        return NULL;
+    }
+    while(!*repl_stop) {
+        int fd = repl_connect(follow_endpoint);
+        if(fd < 0) {
+            repl_sleep(REPL_RETRY_MS);
+            continue;
+        }
+        PROF_MUTEX_LOCK(&repl_lock);
+        f->fd = fd;
+        f->connected = 1;
+        PROF_MUTEX_UNLOCK(&repl_lock);
+
+        follow_stream(f, store, fd, &epoch, buf);
+
+        PROF_MUTEX_LOCK(&repl_lock);
+        close(fd);
+        f->fd = -1;
+        f->connected = 0;
+        PROF_MUTEX_UNLOCK(&repl_lock);
+        if(!*repl_stop) {
+            syslog(LOG_INFO, "replication: channel %d disconnected from primary, retrying", f->channel);
+            repl_sleep(REPL_RETRY_MS);
+        }
+    }
+    repl_buffer_free(buf);
+    return NULL;
+}
+
+int repl_follow(const char *endpoint)
+{
+    follow_endpoint = strdup(endpoint);
+    if(!follow_endpoint) {
+        return -1;
+    }
+    for(int i = 0; i < repl_channels && i < MAX_REPL_CHANNELS; i++) {
+        struct repl_follower *f = &followers[i];
+        f->channel = i;
+        f->fd = -1;
+        if(pthread_create(&f->thread, repl_attr, follower_thread, f) != 0) {
+            syslog(LOG_ERR, "replication: thread creation failed %s", strerror(errno));
+            return -1;
+        }
+        num_followers++;
+    }
+    return 0;
+}
+
+void repl_log_metrics(void)
+{
+    PROF_MUTEX_LOCK(&repl_lock);
+    for(int i = 0; i < REPL_MAX_PEERS; i++) {
+        struct repl_peer *peer = &peers[i];
+        if(!peer->used || peer->finished || peer->channel < 0) {
+            continue;
+        }
+        syslog(LOG_INFO, "replication: follower channel %d sent=%llu acked=%llu lag_bytes=%llu",
+                peer->channel, (unsigned long long)peer->sent, (unsigned long long)peer->acked,
+                (unsigned long long)(peer->primary_size - peer->acked));
+    }
+    for(int i = 0; i < num_followers; i++) {
+        struct repl_follower *f = &followers[i];
+        syslog(LOG_INFO, "replication: channel %d %s replicated=%llu primary=%llu lag_bytes=%llu",
+                f->channel, f->connected ? "connected" : "disconnected",
+                (unsigned long long)f->replicated, (unsigned long long)f->primary_size,
+                (unsigned long long)(f->primary_size > f->replicated ? f->primary_size - f->replicated : 0));
+    }
+    PROF_MUTEX_UNLOCK(&repl_lock);
+}
+
+void repl_shutdown(void)
+{
+    // wake every stream blocked in recv, the stop flag ends their loops
+    PROF_MUTEX_LOCK(&repl_lock);
+    for(int i = 0; i < REPL_MAX_PEERS; i++) {
+        if(peers[i].used && peers[i].fd >= 0) {
+            shutdown(peers[i].fd, SHUT_RDWR);
+        }
+    }
+    for(int i = 0; i < num_followers; i++) {
+        if(followers[i].fd >= 0) {
+            shutdown(followers[i].fd, SHUT_RDWR);
+        }
+    }
+    PROF_MUTEX_UNLOCK(&repl_lock);
+
+    for(int i = 0; i < REPL_MAX_PEERS; i++) {
+        if(peers[i].used) {
+            pthread_join(peers[i].thread, NULL);
+            repl_buffer_free(peers[i].buf);
+            peers[i].used = 0;
+        }
+    }
+    for(int i = 0; i < num_followers; i++) {
+        pthread_join(followers[i].thread, NULL);
+    }
+    num_followers = 0;
+    free(follow_endpoint);
+    follow_endpoint = NULL;
+}
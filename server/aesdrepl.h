@@ -0,0 +1,88 @@
+/*
+ * aesdrepl.h
+ *
+ * Log-shipping replication between aesdsocket processes on one host.
+ *
+ * A primary (-R endpoint) accepts follower connections on a Unix socket
+ * path (any endpoint containing a '/') or a TCP port bound to localhost.
+ * A follower (-F endpoint) opens one connection per channel, says which
+ * offset of that channel's store it already holds, and then receives every
+ * appended byte as frames.  Frames always end on a record boundary.  The follower
+ * acknowledges each frame once it is on disk.  Both sides log replication
+ * lag to syslog via repl_log_metrics().
+ */
+
+#ifndef AESDREPL_H
+#define AESDREPL_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include "aesdpool.h"
+#include "aesdstore.h"
+
+#define REPL_MAGIC 0x4145534cU /* "AESL" */
+/* followers one primary streams to at once */
+#define REPL_MAX_PEERS 32
+
+/* follower -> primary, once per connection */
+struct repl_hello {
+    uint32_t magic;
+    uint32_t channel;
+    /* primary instance the follower's data came from, 0 if none */
+    uint64_t epoch;
+    /* bytes of the channel store the follower already has */
+    uint64_t offset;
+};
+
+/* primary -> follower reply to repl_hello */
+struct repl_welcome {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t epoch;
+    /* offset streaming starts at, the follower truncates to it */
+    uint64_t start;
+};
+
+/* primary -> follower, followed by length bytes of the data file */
+struct repl_frame {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t primary_size;
+};
+
+/* follower -> primary acknowledgement is a bare uint64_t: bytes durable on the follower */
+
+/**
+ * Give the replication code the channel stores and the shutdown flag.
+ * Replication threads are created with @param attr, NULL for the defaults,
+ * and take their STORE_SEND_CHUNK copy buffer from @param buffers, NULL to
+ * allocate it.  A follower needs one buffer per channel; a primary rejects
+ * followers once the slab is exhausted.
+ */
+void repl_init(struct aesd_store *stores, int num_channels, volatile sig_atomic_t *stop,
+        const pthread_attr_t *attr, struct slab *buffers);
+
+/**
+ * Primary: stream to the follower connected on @param fd from a new thread.
+ * @return 0 on success, -1 if the follower was rejected (fd is closed)
+ */
+int repl_serve_follower(int fd);
+
+/**
+ * Follower: start one replication thread per channel against @param endpoint.
+ * @return 0 on success, -1 on error
+ */
+int repl_follow(const char *endpoint);
+
+/**
+ * Log sent/acknowledged offsets and lag of every replication stream.
+ */
+void repl_log_metrics(void);
+
+/**
+ * Stop and join every replication thread, call after setting the stop flag.
+ */
+void repl_shutdown(void);
+
+#endif /* AESDREPL_H */
@@ -0,0 +1,772 @@
+/*
+ * aesdreplay.c
+ *
+ * Replay a session trace captured with "aesdsocket -T <file>" against a
+ * running aesdsocket, see aesdtrace.h for the trace format.
+ *
+ * Every traced connection is reopened on its own thread and sent the same
+ * byte chunks at the captured times, scaled by the speed (-s N, or -s max to
+ * send as fast as the server answers).  After a chunk that completes packets
+ * the next one is held back until every one of them has been answered, and
+ * each packet's latency is the time to the first byte of its reply.  Replies
+ * are the whole store, so each one starts with the store's first line and is
+ * at least as long as the one before; that is how they are told apart.  A
+ * leading "AESDCHANNEL n" line is not a packet, the server does not answer
+ * it.  The echoed output
+ * of each connection, with the server's timestamp lines removed, can be saved
+ * with -o and compared against an earlier run, e.g. of another build, with -c.
+ * Every reply carries the whole store, so sessions that overlap in time see
+ * each other's packets: compare runs made at the same speed, and expect
+ * output differences at max speed, where every session starts at once.
+ *
+ * Usage: aesdreplay [-H host] [-p port | -u path] [-s speed|max] [-o out] [-c ref] trace
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "aesdtrace.h"
+
+/* give up on a connection the server leaves silent this long after we close */
+#define DRAIN_TIMEOUT_MS 5000
+/* and on one whose packets are not answered within this long */
+#define ECHO_TIMEOUT_MS 5000
+#define TIMESTAMP_PREFIX "timestamp:"
+#define CHANNEL_CONTROL "AESDCHANNEL "
+
+struct event {
+    uint64_t time_ns;
+    uint16_t kind;
+    const char *data;
+    uint32_t length;
+};
+
+struct conn {
+    uint32_t id;
+    uint16_t channel;
+    struct event *events;
+    size_t nevents;
+    size_t cap;
+    /* everything the server sent back */
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    /* send times of packets still waiting for their reply, oldest at pending_head */
+    uint64_t *pending;
+    size_t pending_head;
+    size_t npending;
+    size_t pending_cap;
+    size_t packets;
+    /* set while the next newline sent ends a channel control line, not a packet */
+    int control_line;
+    /* reply detection: length of out's first line, 0 until it is complete */
+    size_t first_len;
+    /* start of the next line in out to look at, and when its first byte came */
+    size_t scan;
+    uint64_t scan_ns;
+    /* where the latest reply started and how long the one before it was */
+    size_t reply_start;
+    size_t reply_len;
+    int failed;
+    int started;
+    pthread_t thread;
+};
+
+static const char *host = "localhost";
+static const char *port = "9000";
+static const char *unix_path = NULL;
+/* 0 replays at maximum speed */
+static double speed = 1.0;
+static uint64_t replay_start_ns;
+
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *latencies;
+static size_t nlatencies;
+static size_t latency_cap;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* grow *buf (holding *cap elements of size elem) to hold need elements */
+static int reserve(void **buf, size_t *cap, size_t need, size_t elem)
+{
+    if(need <= *cap) {
+        return 0;
+    }
+    size_t cap2 = *cap ? *cap * 2 : 64;
+    while(cap2 < need) {
+        cap2 *= 2;
+    }
+    void *grown = realloc(*buf, cap2 * elem);
+    if(!grown) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = cap2;
+    return 0;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    char *buf = malloc(st.st_size + 1);
+    size_t got = 0;
+    while(buf && got < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + got, st.st_size - got);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            perror(path);
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    if(buf) {
+        buf[got] = '\0';
+        *len = got;
+    }
+    return buf;
+}
+
+/*
+ * Split the trace in @param data into connections, ordered by connection id,
+ * which is the order the server accepted them in.
+ * @return the number of connections, -1 on a malformed trace
+ */
+static long load_trace(const char *data, size_t len, struct conn **conns_out)
+{
+    struct trace_file_header fh;
+    if(len < sizeof(fh)) {
+        return -1;
+    }
+    memcpy(&fh, data, sizeof(fh));
+    if(memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) != 0) {
+        return -1;
+    }
+    struct conn *conns = NULL;
+    size_t nconns = 0, cap = 0;
+    uint64_t first_ns = 0;
+    int have_first = 0;
+    size_t off = sizeof(fh);
+    while(off + sizeof(struct trace_event) <= len) {
+        struct trace_event ev;
+        memcpy(&ev, data + off, sizeof(ev));
+        off += sizeof(ev);
+        if(ev.length > len - off) {
+            fprintf(stderr, "trace truncated in the middle of an event, ignoring the rest\n");
+            break;
+        }
+        // replay starts with the first captured event
+        if(!have_first) {
+            first_ns = ev.time_ns;
+            have_first = 1;
+        }
+        // connection ids only grow, so a new id is always a new connection
+        struct conn *c = NULL;
+        for(size_t i = nconns; i-- > 0; ) {
+            if(conns[i].id == ev.conn_id) {
+                c = &conns[i];
+                break;
+            }
+            if(conns[i].id < ev.conn_id) {
+                break;
+            }
+        }
+        if(!c) {
+            if(ev.kind != TRACE_OPEN) {
+                // its open happened before the capture started
+                off += ev.length;
+                continue;
+            }
+            if(reserve((void **)&conns, &cap, nconns + 1, sizeof(*conns)) < 0) {
+                return -1;
+            }
+            c = &conns[nconns++];
+            memset(c, 0, sizeof(*c));
+            c->id = ev.conn_id;
+            c->channel = ev.channel;
+        }
+        if(reserve((void **)&c->events, &c->cap, c->nevents + 1, sizeof(*c->events)) < 0) {
+            return -1;
+        }
+        c->events[c->nevents++] = (struct event) {
+            .time_ns = ev.time_ns - first_ns,
+            .kind = ev.kind,
+            .data = data + off,
+            .length = ev.length,
+        };
+        off += ev.length;
+    }
+    *conns_out = conns;
+    return nconns;
+}
+
+static int connect_server(uint16_t channel)
+{
+    if(unix_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    // channel n listens on the base port + n
+    char service[16];
+    snprintf(service, sizeof(service), "%d", atoi(port) + channel);
+    struct addrinfo hints, *res, *rp;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for(rp = res; rp != NULL; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if(fd < 0) {
+            continue;
+        }
+        if(connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static uint64_t scheduled_ns(uint64_t trace_ns)
+{
+    return speed > 0 ? replay_start_ns + (uint64_t)(trace_ns / speed) : replay_start_ns;
+}
+
+/* A reply started at out offset @param start, its first byte arrived at @param at */
+static void reply_started(struct conn *c, size_t start, uint64_t at)
+{
+    if(start > c->reply_start) {
+        c->reply_len = start - c->reply_start;
+    }
+    c->reply_start = start;
+    if(c->pending_head == c->npending) {
+        return;
+    }
+    uint64_t sent = c->pending[c->pending_head++];
+    if(c->pending_head == c->npending) {
+        c->pending_head = c->npending = 0;
+    }
+    pthread_mutex_lock(&latency_lock);
+    if(reserve((void **)&latencies, &latency_cap, nlatencies + 1, sizeof(*latencies)) == 0) {
+        latencies[nlatencies++] = at - sent;
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+/*
+ * Find the replies starting in the bytes received since out offset
+ * @param old_len, which arrived at @param at.  A reply starts on a line equal
+ * to the first line of the first reply, no sooner than the previous reply's
+ * length after the latest start, since the store only grows.
+ */
+static void scan_replies(struct conn *c, size_t old_len, uint64_t at)
+{
+    if(c->scan == old_len) {
+        c->scan_ns = at;
+    }
+    char *nl;
+    while((nl = memchr(c->out + c->scan, '\n', c->out_len - c->scan)) != NULL) {
+        size_t len = nl - (c->out + c->scan) + 1;
+        if(c->first_len == 0) {
+            // the server sends nothing before the first reply
+            c->first_len = len;
+            reply_started(c, c->scan, c->scan_ns);
+        } else if(len == c->first_len && c->scan >= c->reply_start + c->reply_len &&
+                memcmp(c->out + c->scan, c->out, len) == 0) {
+            reply_started(c, c->scan, c->scan_ns);
+        }
+        c->scan += len;
+        c->scan_ns = at;
+    }
+}
+
+/*
+ * Read whatever the server sends until @param deadline_ns (CLOCK_MONOTONIC),
+ * or with @param answered set until no packet is waiting for its reply.
+ * @return 1 on end of stream, 0 at the deadline or once answered, -1 on error
+ */
+static int read_until(struct conn *c, int fd, uint64_t deadline_ns, int answered)
+{
+    for(;;) {
+        if(answered && c->npending == 0) {
+            return 0;
+        }
+        uint64_t now = now_ns();
+        int timeout = now >= deadline_ns ? 0 : (int)((deadline_ns - now + 999999) / 1000000);
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, timeout);
+        if(rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rc < 0) {
+            return -1;
+        }
+        if(rc == 0) {
+            return 0;
+        }
+        if(reserve((void **)&c->out, &c->out_cap, c->out_len + 65536, 1) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(fd, c->out + c->out_len, c->out_cap - c->out_len, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) {
+            return 1;
+        }
+        size_t old_len = c->out_len;
+        c->out_len += n;
+        scan_replies(c, old_len, now_ns());
+    }
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *conn_thread(void *arg)
+{
+    struct conn *c = arg;
+    int fd = connect_server(c->channel);
+    if(fd < 0) {
+        fprintf(stderr, "connection %u: connect failed: %s\n", c->id, strerror(errno));
+        c->failed = 1;
+        return NULL;
+    }
+    for(size_t i = 1; i < c->nevents; i++) {
+        if(c->events[i].kind == TRACE_DATA) {
+            c->control_line = c->events[i].length >= strlen(CHANNEL_CONTROL) &&
+                memcmp(c->events[i].data, CHANNEL_CONTROL, strlen(CHANNEL_CONTROL)) == 0;
+            break;
+        }
+    }
+    int eof = 0;
+    for(size_t i = 1; i < c->nevents && !eof; i++) {
+        struct event *ev = &c->events[i];
+        int rc = read_until(c, fd, scheduled_ns(ev->time_ns), 0);
+        if(rc != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "connection %u: receive failed: %s\n", c->id, strerror(errno));
+            }
+            eof = 1;
+            c->failed = rc < 0;
+            break;
+        }
+        if(ev->kind == TRACE_CLOSE) {
+            break;
+        }
+        if(ev->kind != TRACE_DATA) {
+            continue;
+        }
+        if(send_all(fd, ev->data, ev->length) < 0) {
+            fprintf(stderr, "connection %u: send failed: %s\n", c->id, strerror(errno));
+            c->failed = 1;
+            break;
+        }
+        // the server answers every packet the chunk completes
+        uint64_t sent = now_ns();
+        const char *p = ev->data, *end = ev->data + ev->length;
+        while((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            if(c->control_line) {
+                c->control_line = 0;
+                continue;
+            }
+            if(reserve((void **)&c->pending, &c->pending_cap, c->npending + 1, sizeof(*c->pending)) == 0) {
+                c->pending[c->npending++] = sent;
+            }
+            c->packets++;
+        }
+        rc = read_until(c, fd, sent + ECHO_TIMEOUT_MS * 1000000ULL, 1);
+        if(rc == 0 && c->npending > 0) {
+            fprintf(stderr, "connection %u: %zu packet(s) not answered within %d ms\n",
+                    c->id, c->npending - c->pending_head, ECHO_TIMEOUT_MS);
+            c->failed = 1;
+            break;
+        }
+        if(rc != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "connection %u: receive failed: %s\n", c->id, strerror(errno));
+            }
+            eof = 1;
+            c->failed = 1;
+            break;
+        }
+    }
+    if(!eof && !c->failed) {
+        shutdown(fd, SHUT_WR);
+        int rc = read_until(c, fd, now_ns() + DRAIN_TIMEOUT_MS * 1000000ULL, 0);
+        if(rc < 0) {
+            fprintf(stderr, "connection %u: receive failed: %s\n", c->id, strerror(errno));
+            c->failed = 1;
+        } else if(rc == 0) {
+            fprintf(stderr, "connection %u: server did not close the connection\n", c->id);
+            c->failed = 1;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/* drop the server's timestamp lines, which never match between runs */
+static size_t strip_timestamps(char *buf, size_t len)
+{
+    size_t out = 0;
+    size_t prefix = strlen(TIMESTAMP_PREFIX);
+    for(size_t pos = 0; pos < len; ) {
+        char *nl = memchr(buf + pos, '\n', len - pos);
+        size_t line = nl ? (size_t)(nl - (buf + pos)) + 1 : len - pos;
+        if(line < prefix || memcmp(buf + pos, TIMESTAMP_PREFIX, prefix) != 0) {
+            memmove(buf + out, buf + pos, line);
+            out += line;
+        }
+        pos += line;
+    }
+    return out;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p)
+{
+    if(nlatencies == 0) {
+        return 0.0;
+    }
+    size_t i = (size_t)(p / 100.0 * (nlatencies - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+struct line {
+    const char *p;
+    size_t len;
+};
+
+static int cmp_line(const void *a, const void *b)
+{
+    const struct line *x = a, *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int rc = memcmp(x->p, y->p, n);
+    return rc ? rc : (x->len > y->len) - (x->len < y->len);
+}
+
+static struct line *split_lines(const char *buf, size_t len, size_t *count)
+{
+    struct line *lines = NULL;
+    size_t cap = 0;
+    *count = 0;
+    for(size_t pos = 0; pos < len; ) {
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        size_t n = nl ? (size_t)(nl - (buf + pos)) + 1 : len - pos;
+        if(reserve((void **)&lines, &cap, *count + 1, sizeof(*lines)) < 0) {
+            free(lines);
+            return NULL;
+        }
+        lines[(*count)++] = (struct line) { buf + pos, n };
+        pos += n;
+    }
+    return lines;
+}
+
+/*
+ * Same lines in another order, as happens when overlapping connections are
+ * interleaved differently by the two runs.
+ */
+static int same_lines(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t na, nb;
+    struct line *la = split_lines(a, alen, &na);
+    struct line *lb = split_lines(b, blen, &nb);
+    int same = na == nb && (na == 0 || (la && lb));
+    if(same && na > 0) {
+        qsort(la, na, sizeof(*la), cmp_line);
+        qsort(lb, nb, sizeof(*lb), cmp_line);
+        for(size_t i = 0; i < na && same; i++) {
+            same = cmp_line(&la[i], &lb[i]) == 0;
+        }
+    }
+    free(la);
+    free(lb);
+    return same;
+}
+
+static int write_output(const char *path, struct conn *conns, size_t nconns, size_t packets)
+{
+    FILE *f = fopen(path, "w");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "# aesdreplay connections=%zu packets=%zu p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f\n",
+            nconns, packets, percentile_us(50), percentile_us(90), percentile_us(99), percentile_us(100));
+    for(size_t i = 0; i < nconns; i++) {
+        fprintf(f, "=== connection %u channel %u bytes %zu\n", conns[i].id, conns[i].channel, conns[i].out_len);
+        fwrite(conns[i].out, 1, conns[i].out_len, f);
+    }
+    if(fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compare this run with the -o output of an earlier one.
+ * @return the number of connections whose output differs, -1 on error
+ */
+static long compare_output(const char *path, struct conn *conns, size_t nconns)
+{
+    size_t len;
+    char *ref = read_file(path, &len);
+    if(!ref) {
+        return -1;
+    }
+    double p[4];
+    size_t ref_conns, ref_packets;
+    char *body = memchr(ref, '\n', len);
+    if(!body || sscanf(ref, "# aesdreplay connections=%zu packets=%zu p50_us=%lf p90_us=%lf p99_us=%lf max_us=%lf",
+                &ref_conns, &ref_packets, &p[0], &p[1], &p[2], &p[3]) != 6) {
+        fprintf(stderr, "%s: not an aesdreplay output file\n", path);
+        free(ref);
+        return -1;
+    }
+    body++;
+    long differ = 0;
+    size_t reordered = 0;
+    size_t i = 0;
+    while(body < ref + len) {
+        unsigned id, channel;
+        size_t bytes;
+        char *nl = memchr(body, '\n', ref + len - body);
+        if(!nl || sscanf(body, "=== connection %u channel %u bytes %zu", &id, &channel, &bytes) != 3 ||
+                bytes > (size_t)(ref + len - (nl + 1))) {
+            fprintf(stderr, "%s: malformed connection header\n", path);
+            free(ref);
+            return -1;
+        }
+        char *data = nl + 1;
+        body = data + bytes;
+        // the server numbers connections per run, so match them by position
+        if(i >= nconns) {
+            printf("connection %u: missing from this run\n", id);
+            differ++;
+            continue;
+        }
+        struct conn *c = &conns[i++];
+        if(bytes == c->out_len && memcmp(data, c->out, bytes) == 0) {
+            continue;
+        }
+        if(same_lines(data, bytes, c->out, c->out_len)) {
+            reordered++;
+            continue;
+        }
+        printf("connection %u: output differs (%zu bytes, reference %zu)\n", c->id, c->out_len, bytes);
+        differ++;
+    }
+    if(i < nconns) {
+        printf("%zu connection(s) not in the reference\n", nconns - i);
+        differ += nconns - i;
+    }
+    static const char *names[] = { "p50", "p90", "p99", "max" };
+    static const double pct[] = { 50, 90, 99, 100 };
+    printf("first byte latency vs %s:\n", path);
+    for(int k = 0; k < 4; k++) {
+        double cur = percentile_us(pct[k]);
+        printf("  %s %10.1f us -> %10.1f us (%+.1f%%)\n", names[k], p[k], cur,
+                p[k] > 0 ? (cur - p[k]) * 100.0 / p[k] : 0.0);
+    }
+    printf("output: %zu connection(s) compared, %zu reordered, %ld differ\n",
+            i, reordered, differ);
+    free(ref);
+    return differ;
+}
+
+static int usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port | -u path] [-s speed|max] [-o out] [-c ref] trace\n", prog);
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL;
+    const char *ref_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:u:s:o:c:")) != -1) {
+        switch(opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 's':
+            speed = strcmp(optarg, "max") == 0 ? 0.0 : atof(optarg);
+            if(speed < 0) {
+                return usage(argv[0]);
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            ref_path = optarg;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) {
+        return usage(argv[0]);
+    }
+
+    size_t trace_len;
+    char *trace = read_file(argv[optind], &trace_len);
+    if(!trace) {
+        return 1;
+    }
+    struct conn *conns = NULL;
+    long nconns = load_trace(trace, trace_len, &conns);
+    if(nconns < 0) {
+        fprintf(stderr, "%s: not a valid aesdsocket trace\n", argv[optind]);
+        return 1;
+    }
+    if(unix_path) {
+        for(long i = 0; i < nconns; i++) {
+            if(conns[i].channel != 0) {
+                fprintf(stderr, "warning: connection %u was on channel %u, replaying it on %s\n",
+                        conns[i].id, conns[i].channel, unix_path);
+            }
+        }
+    }
+
+    // start each connection at its captured open time
+    replay_start_ns = now_ns();
+    long started = 0;
+    for(long i = 0; i < nconns; i++) {
+        uint64_t at = scheduled_ns(conns[i].events[0].time_ns);
+        uint64_t now = now_ns();
+        if(at > now) {
+            struct timespec ts = { (at - now) / 1000000000ULL, (at - now) % 1000000000ULL };
+            while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+            }
+        }
+        if(pthread_create(&conns[i].thread, NULL, conn_thread, &conns[i]) != 0) {
+            fprintf(stderr, "connection %u: thread creation failed\n", conns[i].id);
+            conns[i].failed = 1;
+            continue;
+        }
+        conns[i].started = 1;
+        started++;
+    }
+    size_t packets = 0, failed = 0, bytes = 0;
+    for(long i = 0; i < nconns; i++) {
+        if(conns[i].started) {
+            pthread_join(conns[i].thread, NULL);
+        }
+        packets += conns[i].packets;
+        failed += conns[i].failed;
+        conns[i].out_len = strip_timestamps(conns[i].out, conns[i].out_len);
+        bytes += conns[i].out_len;
+    }
+    double secs = (now_ns() - replay_start_ns) / 1e9;
+    qsort(latencies, nlatencies, sizeof(*latencies), cmp_u64);
+
+    char pace[32];
+    if(speed > 0) {
+        snprintf(pace, sizeof(pace), "%gx", speed);
+    } else {
+        snprintf(pace, sizeof(pace), "max");
+    }
+    printf("replayed %ld connection(s), %zu packet(s) in %.3f s at %s speed, %zu failed\n",
+            started, packets, secs, pace, failed);
+    printf("first byte latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us (%zu samples)\n",
+            percentile_us(50), percentile_us(90), percentile_us(99), percentile_us(100), nlatencies);
+    printf("echoed %zu bytes without timestamp lines\n", bytes);
+
+    int rc = failed ? 1 : 0;
+    if(out_path && write_output(out_path, conns, nconns, packets) < 0) {
+        rc = 1;
+    }
+    if(ref_path) {
+        long differ = compare_output(ref_path, conns, nconns);
+        if(differ != 0) {
+            rc = 1;
+        }
+    }
+
+    for(long i = 0; i < nconns; i++) {
+        free(conns[i].events);
+        free(conns[i].out);
+        free(conns[i].pending);
+    }
+    free(conns);
+    free(latencies);
+    free(trace);
+    return rc;
+}
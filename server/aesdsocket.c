@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // recvmmsg
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
@@ -12,38 +13,148 @@
 #include <pthread.h>
 #include <sys/queue.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <limits.h>
+#include "lockprof.h"
+#include "aesdpool.h"
+#include "aesdstore.h"
+#include "aesdrepl.h"
+#include "aesdtrace.h"
 
 struct thread_node {
     pthread_t thread_id;
     int client_fd;
+    uint32_t conn_id;
     int completed;
+    // channel of the listener the connection arrived on
+    int channel;
+    // channel this connection stores to and replays from
+    struct aesd_store *store;
+    // first line may still be a channel control line
+    int may_select_channel;
+    // bytes received after the last complete packet
+    char* recv_buff;
+    size_t recv_len;
+    // fixed size of recv_buff, 0 when it grows on demand
+    size_t recv_cap;
+    // STORE_SEND_CHUNK bytes for replies from the send pool, budget mode only
+    char* send_buff;
+    // thread stack from the stack pool, budget mode only
+    void* stack;
     SLIST_ENTRY(thread_node) entries;
 };
 
 SLIST_HEAD(slist_head, thread_node);
 static struct slist_head thread_list_head;
 #define BUFF_SIZE 1024
+#define MAX_CHANNELS 16
+// channel ports plus replication, Unix stream and seqpacket endpoints
+#define MAX_LISTENERS (MAX_CHANNELS + 3)
+// datagrams taken per recvmmsg() call and the largest one accepted
+#define DGRAM_BATCH STORE_BATCH_MAX
+#define DGRAM_MAX 4096
+// budget mode defaults: packet (receive buffer) bytes and thread stack size
+#define BUDGET_PACKET_DEFAULT 4096
+#define BUDGET_STACK_DEFAULT (256 * 1024)
+// threads peak below 20 KiB with syslog, getaddrinfo and TLS included,
+// large I/O buffers live on the heap
+#define BUDGET_STACK_MIN (32 * 1024)
+#define CHANNEL_CONTROL "AESDCHANNEL "
+// room for a burst of connects, e.g. aesdreplay at max speed
+#define LISTEN_BACKLOG 128
+
+enum listener_kind {
+    LISTEN_CLIENT,
+    LISTEN_REPLICATION,
+    // SOCK_SEQPACKET, every message is one packet
+    LISTEN_DATAGRAM,
+};
+
+// a listening socket and the channel its connections start on
+struct listener {
+    int fd;
+    int channel;
+    enum listener_kind kind;
+    // bound Unix socket path to unlink at exit, NULL for TCP
+    const char* path;
+};
 
 volatile sig_atomic_t stop_requested = 0;
-static int sock_fd = -1;
-static int file_fd = -1;
+static struct listener listeners[MAX_LISTENERS];
+static int num_listeners = 0;
+static int base_port = 9000;
 const char* file_path = "/var/tmp/aesdsocketdata";
-static char* recv_buff = NULL;
-static int recv_len = 0;
+// follower replicas are "<prefix>-<base port>": apart from the primary and,
+// since every process binds its own ports, from each other
+#define REPLICA_PATH_PREFIX "/var/tmp/aesdsocketdata-replica"
+static char replica_path[64];
+// set in follower mode: serve replay only, the primary supplies the data
+static const char* follow_endpoint = NULL;
 
-pthread_mutex_t mut;
+// one independent store (file, lock and replay stream) per channel
+static struct aesd_store stores[MAX_CHANNELS];
+static int num_channels = 1;
 pthread_t time_log_thread;
+static uint32_t next_conn_id = 0;
 
-void cleanup() { 
-    if(sock_fd != -1) {
-        close(sock_fd);
-        sock_fd = -1;
+// memory budget mode (-m): every connection is carved out of these pools
+static int budget_mode = 0;
+static size_t budget_conns = 0;
+static size_t budget_packet = BUDGET_PACKET_DEFAULT;
+static size_t budget_stack = BUDGET_STACK_DEFAULT;
+static struct slab node_pool;
+static struct slab buffer_pool;
+static struct slab stack_pool;
+static struct slab send_pool;
+// STORE_SEND_CHUNK buffers of the replication threads
+static struct slab repl_pool;
+// fixed stack size for the log and replication threads
+static pthread_attr_t service_attr;
+
+/*
+ * Give back everything a joined connection holds: its receive and send
+ * buffers, its stack and the node itself.
+ */
+static void releaseNode(struct thread_node *node) {
+    if(budget_mode) {
+        slab_free(&buffer_pool, node->recv_buff);
+        slab_free(&send_pool, node->send_buff);
+        slab_free(&stack_pool, node->stack);
+        slab_free(&node_pool, node);
+    } else {
+        free(node->recv_buff);
+        free(node);
     }
-    if(file_fd != -1) {
-        close(file_fd);
-        file_fd = -1;
+}
+
+static void reportBudget() {
+    slab_report(&node_pool);
+    slab_report(&buffer_pool);
+    slab_report(&stack_pool);
+    slab_report(&send_pool);
+    if(repl_pool.mem) {
+        slab_report(&repl_pool);
     }
+}
 
+void closeListeners() {
+    for(int i = 0; i < num_listeners; i++) {
+        if(listeners[i].fd != -1) {
+            close(listeners[i].fd);
+            listeners[i].fd = -1;
+        }
+        if(listeners[i].path) {
+            unlink(listeners[i].path);
+            listeners[i].path = NULL;
+        }
+    }
+}
+
+void cleanup() { 
+    // also ends the replication streams when called on an error path
+    stop_requested = 1;
+    closeListeners();
     // join all the threads before cleanup
     struct thread_node *iter, *tmp;
     iter = SLIST_FIRST(&thread_list_head);
@@ -51,28 +162,41 @@ void cleanup() {
         tmp = SLIST_NEXT(iter, entries);
         pthread_join(iter->thread_id, NULL);
         SLIST_REMOVE(&thread_list_head, iter, thread_node, entries);
-        free(iter);
+        releaseNode(iter);
         iter = tmp;
     }
 
-    //join log thread
+    //join log thread and replication streams
     pthread_join(time_log_thread, NULL);
-    //destroy the mutex
-    pthread_mutex_destroy(&mut);
-    //delete the file
-    remove("/var/tmp/aesdsocketdata");
+    repl_shutdown();
+    trace_close();
+    //close the stores and delete their files
+    for(int i = 0; i < num_channels; i++) {
+        store_close(&stores[i], 1);
+    }
+    if(budget_mode) {
+        reportBudget();
+        slab_destroy(&node_pool);
+        slab_destroy(&buffer_pool);
+        slab_destroy(&stack_pool);
+        slab_destroy(&send_pool);
+        slab_destroy(&repl_pool);
+        pthread_attr_destroy(&service_attr);
+    }
     //close syslog
     closelog();
 }
 
-void openAndBindSocket(int* sock_fd) {
+// host NULL binds every interface
+void openAndBindSocket(int* sock_fd, const char* host, const char* port, int socktype) {
     struct addrinfo hints, *res, *resptr;
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE; // for bind
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
 
-    if(getaddrinfo(NULL, "9000", &hints, &res) != 0) {
+    *sock_fd = -1;
+    if(getaddrinfo(host, port, &hints, &res) != 0) {
         syslog(LOG_ERR,"getaddrinfo error, returning");
         return;
     }
@@ -81,6 +205,9 @@ void openAndBindSocket(int* sock_fd) {
                 resptr->ai_socktype,
                 resptr->ai_protocol);
         if(*sock_fd == -1) continue;
+        // allow a restarted server to rebind while old connections sit in TIME_WAIT
+        int reuse = 1;
+        setsockopt(*sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
         if(bind(*sock_fd, resptr->ai_addr, resptr->ai_addrlen) == 0) {
             //bind successfull
             break;
@@ -89,6 +216,7 @@ void openAndBindSocket(int* sock_fd) {
     }
     if (resptr == NULL) {
         //bind failed
+        *sock_fd = -1;
         syslog(LOG_ERR,"bind error : %s\n", strerror(errno));
         freeaddrinfo(res);
         return;
@@ -96,147 +224,297 @@ void openAndBindSocket(int* sock_fd) {
     freeaddrinfo(res); // free the linked list
 }
 
+void openAndBindUnixSocket(int* sock_fd, const char* path, int socktype) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "unix socket path too long : %s", path);
+        *sock_fd = -1;
+        return;
+    }
+    strcpy(addr.sun_path, path);
+    *sock_fd = socket(AF_UNIX, socktype, 0);
+    if(*sock_fd == -1) {
+        return;
+    }
+    // a stale socket file from an earlier run would make bind fail
+    unlink(path);
+    if(bind(*sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR,"bind error on %s : %s\n", path, strerror(errno));
+        close(*sock_fd);
+        *sock_fd = -1;
+    }
+}
+
 void handle_signal(int signo) {
     if(signo == SIGINT || signo == SIGTERM) {
         syslog(LOG_ERR, "Caught signal,exiting");
         stop_requested = 1;
-        shutdown(sock_fd, SHUT_RDWR);
+        for(int i = 0; i < num_listeners; i++) {
+            shutdown(listeners[i].fd, SHUT_RDWR);
+        }
     }
 }
 
-int sendDataToClient(int* client_fd) {
-    pthread_mutex_lock(&mut);
-    file_fd = open(file_path,O_RDONLY);
-    if (file_fd < 0 ) {
-        syslog(LOG_ERR, "Error opening file /var/tmp/aesdsocketdata : %s", strerror(errno));
-        pthread_mutex_unlock(&mut);
-        return -1;
+/*
+ * Handle a "AESDCHANNEL <n>" control line, only accepted as the first line
+ * of a connection when several channels are configured.
+ * Returns 1 if @param packet was a control line and has been consumed.
+ */
+static int selectChannel(struct thread_node *node, const char *packet, size_t len) {
+    size_t prefix = strlen(CHANNEL_CONTROL);
+    if(len <= prefix || strncmp(packet, CHANNEL_CONTROL, prefix) != 0) {
+        return 0;
     }
-    char buff[BUFF_SIZE];
-    ssize_t bytes_read = 0;
-    while( (bytes_read = read(file_fd, buff, BUFF_SIZE)) > 0 ) {
-        int offset = 0;
-        while(offset < bytes_read) {
-            int bytes_sent = send(*client_fd, buff+offset, bytes_read-offset, 0);
-            if(bytes_sent < 0) {
-                syslog(LOG_ERR, "Error while sending the data to client %s", strerror(errno));
-                pthread_mutex_unlock(&mut);
-                return -1;
-            } else {
-               syslog(LOG_DEBUG, " bytes_sent : %d",bytes_sent);
-               /* printf("bytes sent : %d\n", bytes_sent);
-                write(STDOUT_FILENO, buff + offset, bytes_sent);
-                write(STDOUT_FILENO, "\n", 1);*/
-            }
-            offset += bytes_sent;
-        }
+    char *end;
+    long channel = strtol(packet + prefix, &end, 10);
+    if(end == packet + prefix || *end != '\n' || channel < 0 || channel >= num_channels) {
+        return 0;
     }
-    close(file_fd);
-    pthread_mutex_unlock(&mut);
-    return (bytes_read < 0) ? -1 : 0; 
+    node->store = &stores[channel];
+    syslog(LOG_INFO, "connection %u selected channel %ld", node->conn_id, channel);
+    return 1;
 }
 
-int receiveData(char** buf, int* client_fd) {
-    char temp_buff[BUFF_SIZE];
-    ssize_t bytes = recv(*client_fd, temp_buff, sizeof(temp_buff), 0);
+int receiveData(struct thread_node *node) {
+    // receive straight into the persistent buffer, after any partial packet
+    size_t room;
+    if(node->recv_cap) {
+        // fixed budget: whatever room is left, complete packets were consumed below
+        room = node->recv_cap - node->recv_len;
+    } else {
+        char* new_buff = realloc(node->recv_buff, node->recv_len + BUFF_SIZE);
+        if (!new_buff) {
+            syslog(LOG_ERR, "realloc error %s", strerror(errno));
+            return -1;
+        }
+        node->recv_buff = new_buff;
+        room = BUFF_SIZE;
+    }
+    ssize_t bytes = recv(node->client_fd, node->recv_buff + node->recv_len, room, 0);
     if(bytes < 0) {
         syslog(LOG_ERR, " recv failed : %s", strerror(errno));
         return -1;
     }
 
     if(bytes == 0) {
-        free(recv_buff);
-        recv_buff = NULL;
-        recv_len = 0;
         return 0; //client disconnected
     }
+    trace_record(node->conn_id, TRACE_DATA, node->channel, node->recv_buff + node->recv_len, bytes);
+    node->recv_len += bytes;
 
-    // append the new buffer to the persistent buffer
-    char* new_buff = realloc(recv_buff, recv_len+bytes);
-    if (!new_buff) {
-        syslog(LOG_ERR, "realloc error %s", strerror(errno));
-        return -1;
+    // handle every complete packet in this buffer
+    size_t consumed = 0;
+    char *newline;
+    while((newline = memchr(node->recv_buff+consumed, '\n', node->recv_len-consumed)) != NULL) {
+        char *packet = node->recv_buff + consumed;
+        size_t packet_len = newline - packet + 1; // include '\n'
+        consumed += packet_len;
+        if(node->may_select_channel) {
+            node->may_select_channel = 0;
+            if(selectChannel(node, packet, packet_len)) {
+                continue;
+            }
+        }
+        //append packet data to the channel store, followers only replay
+        if(!follow_endpoint &&
+                store_append(node->store, RECORD_PACKET, node->conn_id, packet, packet_len) < 0) {
+            return -1;
+        }
+        // send data back to the client
+        if(store_send_all(node->store, node->client_fd, node->send_buff) < 0) {
+            syslog(LOG_ERR, "error sending data to client\n");
+            return -1;
+        }
     }
-    recv_buff = new_buff;
-    memcpy(recv_buff+recv_len, temp_buff, bytes);
-    recv_len += bytes;
-
-    // find newline in this buffer
-    char *newline = memchr(recv_buff, '\n', recv_len);
-    if(!newline) {
+    if(consumed == 0) {
         syslog(LOG_INFO, "packet not complete yet\n");
-        return 1;
     }
-
-    size_t packet_len = newline - recv_buff + 1; // include '\n'
-                                                 //allocate memory for output buffer
-    *buf = malloc(packet_len);
-    if(!*buf) return -1;
-    memcpy(*buf, recv_buff, packet_len);
     // remove consumed data
-    size_t remaining = recv_len - packet_len;
-    memmove(recv_buff, recv_buff+packet_len, remaining);
-    recv_len = remaining;
-    pthread_mutex_lock(&mut);
-    //append packet data to file
-    file_fd = open(file_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (file_fd < 0 ) {
-        syslog(LOG_ERR, "Error opening file /var/tmp/aesdsocketdata : %s", strerror(errno));
-        pthread_mutex_unlock(&mut);
-        return -1;
-    }
-    size_t written = 0;
-    while(written < packet_len) {
-        ssize_t bytes_written = write(file_fd,*buf+written, packet_len-written);
-        //syslog(LOG_DEBUG, " bytes_written : %ld packet_len : %ld written : %ld", bytes_written, packet_len, written);
-        if (bytes_written < 0) {
-            syslog(LOG_ERR, "Error writing to file /var/tmp/aesdsocketdata : %s", strerror(errno));
-            pthread_mutex_unlock(&mut);
-            return -1;
-        }
-        written += bytes_written;
-    }
-    close(file_fd);
-    pthread_mutex_unlock(&mut);
-    // send data back to the client
-    if(sendDataToClient(client_fd) < 0) {
-        syslog(LOG_ERR, "error sending data to client\n");
+    memmove(node->recv_buff, node->recv_buff+consumed, node->recv_len-consumed);
+    node->recv_len -= consumed;
+    if(node->recv_cap && node->recv_len == node->recv_cap) {
+        // a full buffer without a newline cannot ever hold the packet
+        syslog(LOG_ERR, "connection %u: packet exceeds %zu byte budget, closing",
+                node->conn_id, node->recv_cap);
         return -1;
     }
 
-    return packet_len;
+    return bytes;
 }
 
 void *client_thread(void *arg) {
     //receive data
     struct thread_node *node = arg;
-    int client_fd = node->client_fd;
-    char* packet = NULL;
     int len;
+    trace_record(node->conn_id, TRACE_OPEN, node->channel, NULL, 0);
     while(1) {
-        len = receiveData(&packet, &client_fd);
+        len = receiveData(node);
         if(len < 0) {
-            //error occured
-            cleanup();
-            free(packet);
-            close(client_fd);
-            exit(EXIT_FAILURE);
+            //error with send/recv, drop only this connection
+            break;
         }else if(len == 0) {
             //client disconnected
             syslog(LOG_INFO, "client disconnected\n");
             break;
-        }else if(len == -1) {
-            //error with send/recv
-            break;
         }
     }
-    close(client_fd);
-    free(packet);
+    trace_record(node->conn_id, TRACE_CLOSE, node->channel, NULL, 0);
+    close(node->client_fd);
     node->completed = 1;
     syslog(LOG_INFO, "End---->Closed connection");
     return NULL;
 }
 
+/*
+ * A zero length read on a seqpacket connection is either an empty message or
+ * the peer closing; @return 1 only when the peer has shut down and nothing
+ * is left to read.
+ */
+static int seqpacketClosed(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+    char c;
+    if(poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLRDHUP | POLLHUP))) {
+        return 0;
+    }
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/*
+ * Ingest loop for a UDP socket or an accepted SOCK_SEQPACKET connection.
+ * Each datagram is one packet (a missing trailing newline is added) and every
+ * recvmmsg() batch is appended to the store under a single lock.  Datagram
+ * senders get no echo, they replay over a stream connection like everyone else.
+ */
+void *datagram_thread(void *arg) {
+    struct thread_node *node = arg;
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH];
+    struct iovec packets[DGRAM_BATCH];
+    int type = SOCK_DGRAM;
+    socklen_t type_len = sizeof(type);
+    getsockopt(node->client_fd, SOL_SOCKET, SO_TYPE, &type, &type_len);
+
+    // one slot per datagram, with room for the added newline
+    if(!node->recv_buff) {
+        node->recv_cap = DGRAM_BATCH * (DGRAM_MAX + 1);
+        node->recv_buff = malloc(node->recv_cap);
+        if(!node->recv_buff) {
+            syslog(LOG_ERR, "malloc error %s", strerror(errno));
+        }
+    }
+    // a budget sized buffer holds fewer, possibly smaller, slots
+    size_t slot = node->recv_cap < DGRAM_MAX + 1 ? node->recv_cap : DGRAM_MAX + 1;
+    int batch = node->recv_cap / slot < DGRAM_BATCH ? node->recv_cap / slot : DGRAM_BATCH;
+    while(node->recv_buff && !stop_requested) {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < batch; i++) {
+            iovs[i].iov_base = node->recv_buff + i * slot;
+            iovs[i].iov_len = slot - 1;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(node->client_fd, msgs, batch, MSG_WAITFORONE, NULL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, " recvmmsg failed : %s", strerror(errno));
+            break;
+        }
+        int count = 0;
+        int empty = 0;
+        for(int i = 0; i < n; i++) {
+            size_t len = msgs[i].msg_len;
+            if(len == 0) {
+                // empty messages carry no packet, but may mean the peer closed
+                empty = 1;
+                continue;
+            }
+            if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                syslog(LOG_ERR, "dropping datagram larger than %zu bytes", slot - 1);
+                continue;
+            }
+            char *packet = iovs[i].iov_base;
+            if(packet[len - 1] != '\n') {
+                packet[len++] = '\n';
+            }
+            packets[count].iov_base = packet;
+            packets[count].iov_len = len;
+            count++;
+        }
+        if(count > 0 &&
+                store_append_batch(node->store, RECORD_PACKET, node->conn_id, packets, count) < 0) {
+            break;
+        }
+        if(empty && type == SOCK_SEQPACKET && seqpacketClosed(node->client_fd)) {
+            break;
+        }
+    }
+    close(node->client_fd);
+    node->completed = 1;
+    syslog(LOG_INFO, "End---->Closed datagram endpoint");
+    return NULL;
+}
+
+/*
+ * Start @param handler for @param fd on its own thread and track it in the
+ * thread list.  In budget mode the node, receive and send buffers and stack
+ * come from the pools and the connection is refused once any of them is exhausted.
+ * Closes @param fd if the connection cannot be started.
+ */
+static struct thread_node *startConnection(int fd, int channel, void *(*handler)(void *)) {
+    struct thread_node *node;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if(budget_mode) {
+        node = slab_alloc(&node_pool);
+        if(node) {
+            memset(node, 0, sizeof(*node));
+            node->recv_buff = slab_alloc(&buffer_pool);
+            node->recv_cap = budget_packet;
+            node->send_buff = slab_alloc(&send_pool);
+            node->stack = slab_alloc(&stack_pool);
+        }
+        if(!node || !node->recv_buff || !node->send_buff || !node->stack) {
+            syslog(LOG_WARNING, "connection limit of %zu reached, rejecting", budget_conns);
+            if(node) {
+                releaseNode(node);
+            }
+            pthread_attr_destroy(&attr);
+            close(fd);
+            return NULL;
+        }
+        pthread_attr_setstack(&attr, node->stack, budget_stack);
+    } else {
+        node = calloc(1, sizeof(*node));
+        if(!node) {
+            syslog(LOG_ERR, "calloc error %s", strerror(errno));
+            pthread_attr_destroy(&attr);
+            close(fd);
+            return NULL;
+        }
+    }
+    node->completed = 0;
+    node->client_fd = fd;
+    node->conn_id = ++next_conn_id;
+    node->channel = channel;
+    node->store = &stores[channel];
+    node->may_select_channel = num_channels > 1 && channel == 0 && handler == client_thread;
+    //create thread for each connection
+    int rc = pthread_create(&node->thread_id, &attr, handler, node);
+    pthread_attr_destroy(&attr);
+    if(rc != 0) {
+        syslog(LOG_ERR, "Thread creation failed %s\n",strerror(rc));
+        releaseNode(node);
+        close(fd);
+        return NULL;
+    }
+    SLIST_INSERT_HEAD(&thread_list_head, node, entries);
+    return node;
+}
+
 void *log_time(void *arg) {
     time_t now;
     char ts[128]; // ts string
@@ -246,16 +524,14 @@ void *log_time(void *arg) {
         gmtime_r(&now, &tm_now);
         strftime(ts, sizeof(ts), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_now);
         syslog(LOG_DEBUG, " timestamp : %s\n", ts);
-        int fd = open(file_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if(fd < 0) {
-            syslog(LOG_ERR, "error while opening file : %s %s\n", file_path, strerror(errno));
-            pthread_mutex_unlock(&mut);
-            return NULL;
+        //a follower's store only holds what the primary sends
+        for(int i = 0; i < num_channels && !follow_endpoint; i++) {
+            store_append(&stores[i], RECORD_TIMESTAMP, 0, ts, strlen(ts));
+        }
+        repl_log_metrics();
+        if(budget_mode) {
+            reportBudget();
         }
-        pthread_mutex_lock(&mut);
-        write(fd, ts, strlen(ts));
-        pthread_mutex_unlock(&mut);
-        close(fd);
         struct timespec ts_sleep = {1, 0};
         for(int i=0; i<10 && !stop_requested; i++) {
             nanosleep(&ts_sleep, NULL);
@@ -266,8 +542,86 @@ void *log_time(void *arg) {
 
 int main(int args, char* argv[]) {
     int daemon_mode = 0;
-    if(args == 2 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    enum store_format format = STORE_FORMAT_TEXT;
+    int opt;
+    const char* repl_endpoint = NULL;
+    const char* unix_path = NULL;
+    const char* dgram_endpoint = NULL;
+    const char* trace_path = NULL;
+    while((opt = getopt(args, argv, "drc:p:R:F:u:g:m:T:")) != -1) {
+        switch(opt) {
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'r':
+            //indexed record format instead of raw text, see aesdstore.h
+            format = STORE_FORMAT_RECORD;
+            break;
+        case 'c':
+            //channels, each with its own store; channel n also listens on port+n
+            num_channels = atoi(optarg);
+            if(num_channels < 1 || num_channels > MAX_CHANNELS) {
+                fprintf(stderr, "channels must be 1..%d\n", MAX_CHANNELS);
+                return -1;
+            }
+            break;
+        case 'p':
+            base_port = atoi(optarg);
+            if(base_port <= 0 || base_port > 65535 - MAX_CHANNELS) {
+                fprintf(stderr, "invalid port %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            //primary: accept followers on this Unix socket path or port
+            repl_endpoint = optarg;
+            break;
+        case 'F':
+            //follower: replicate from the primary at this endpoint, serve replay only
+            follow_endpoint = optarg;
+            break;
+        case 'u':
+            //local clients on a Unix stream socket, same protocol as port 9000
+            unix_path = optarg;
+            break;
+        case 'g':
+            //datagram ingest: SOCK_SEQPACKET on a Unix socket path, else UDP port
+            dgram_endpoint = optarg;
+            break;
+        case 'T':
+            //capture every stream connection's inbound bytes for aesdreplay
+            trace_path = optarg;
+            break;
+        case 'm': {
+            //fixed memory budget: connections[:packet bytes[:stack KiB]]
+            size_t stack_kb = BUDGET_STACK_DEFAULT / 1024;
+            int fields = sscanf(optarg, "%zu:%zu:%zu", &budget_conns, &budget_packet, &stack_kb);
+            budget_stack = stack_kb * 1024;
+            size_t stack_min = BUDGET_STACK_MIN > PTHREAD_STACK_MIN ? BUDGET_STACK_MIN : PTHREAD_STACK_MIN;
+            if(fields < 1 || budget_conns < 1 || budget_packet < 2 || budget_stack < stack_min) {
+                fprintf(stderr, "invalid budget %s, need connections >= 1, packet >= 2, stack >= %zu KiB\n",
+                        optarg, stack_min / 1024);
+                return -1;
+            }
+            budget_mode = 1;
+            break;
+        }
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-r] [-c channels] [-p port] [-u path] [-g endpoint] [-m conns[:packet[:stack_kb]]] [-T trace] [-R endpoint | -F endpoint]\n", argv[0]);
+            return -1;
+        }
+    }
+    if(repl_endpoint && follow_endpoint) {
+        fprintf(stderr, "-R and -F are mutually exclusive\n");
+        return -1;
+    }
+    if(follow_endpoint) {
+        snprintf(replica_path, sizeof(replica_path), "%s-%d", REPLICA_PATH_PREFIX, base_port);
+        file_path = replica_path;
+    }
+    if(dgram_endpoint && follow_endpoint) {
+        fprintf(stderr, "a follower cannot ingest datagrams\n");
+        return -1;
     }
     /* open syslog connection */
     openlog("aesdsocket_log", LOG_PID, LOG_USER);
@@ -292,19 +646,88 @@ int main(int args, char* argv[]) {
         return -1;
     }
 
+    //a client closing early must fail its send, not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-    //create socket
-    openAndBindSocket(&sock_fd);
-    if (sock_fd < 0) {
-        syslog(LOG_ERR, "socket creation failed : %s\n", strerror(errno));
-        return -1;
+
+    //create one listening socket per channel
+    for(int i = 0; i < num_channels; i++) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", base_port + i);
+        openAndBindSocket(&listeners[i].fd, NULL, port, SOCK_STREAM);
+        listeners[i].channel = i;
+        listeners[i].kind = LISTEN_CLIENT;
+        if (listeners[i].fd < 0) {
+            syslog(LOG_ERR, "socket creation failed on port %s : %s\n", port, strerror(errno));
+            closeListeners();
+            return -1;
+        }
+        num_listeners++;
+    }
+    //replication endpoint for followers
+    if(repl_endpoint) {
+        struct listener *l = &listeners[num_listeners];
+        l->kind = LISTEN_REPLICATION;
+        l->channel = 0;
+        if(strchr(repl_endpoint, '/')) {
+            openAndBindUnixSocket(&l->fd, repl_endpoint, SOCK_STREAM);
+            l->path = repl_endpoint;
+        } else {
+            // followers run on this host, keep the unauthenticated stream off the network
+            openAndBindSocket(&l->fd, "localhost", repl_endpoint, SOCK_STREAM);
+        }
+        if(l->fd < 0) {
+            syslog(LOG_ERR, "replication socket creation failed on %s : %s\n", repl_endpoint, strerror(errno));
+            closeListeners();
+            return -1;
+        }
+        num_listeners++;
+    }
+    //local stream clients, starting on channel 0
+    if(unix_path) {
+        struct listener *l = &listeners[num_listeners];
+        l->kind = LISTEN_CLIENT;
+        l->channel = 0;
+        openAndBindUnixSocket(&l->fd, unix_path, SOCK_STREAM);
+        if(l->fd < 0) {
+            syslog(LOG_ERR, "unix socket creation failed on %s : %s\n", unix_path, strerror(errno));
+            closeListeners();
+            return -1;
+        }
+        l->path = unix_path;
+        num_listeners++;
+    }
+    //datagram ingest into channel 0, UDP needs no listener and is bound here
+    int udp_fd = -1;
+    if(dgram_endpoint) {
+        int seqpacket = strchr(dgram_endpoint, '/') != NULL;
+        int dgram_fd;
+        if(seqpacket) {
+            openAndBindUnixSocket(&dgram_fd, dgram_endpoint, SOCK_SEQPACKET);
+        } else {
+            openAndBindSocket(&dgram_fd, NULL, dgram_endpoint, SOCK_DGRAM);
+        }
+        if(dgram_fd < 0) {
+            syslog(LOG_ERR, "datagram socket creation failed on %s : %s\n", dgram_endpoint, strerror(errno));
+            closeListeners();
+            return -1;
+        }
+        if(seqpacket) {
+            struct listener *l = &listeners[num_listeners++];
+            l->fd = dgram_fd;
+            l->kind = LISTEN_DATAGRAM;
+            l->channel = 0;
+            l->path = dgram_endpoint;
+        } else {
+            udp_fd = dgram_fd;
+        }
     }
     // run as daemon
     if (daemon_mode) {
         pid_t pid = fork();
         if(pid < 0) {
             syslog(LOG_ERR,"fork error : %s", strerror(errno));
-            close(sock_fd);
+            closeListeners();
             exit(EXIT_FAILURE);
         }
         if (pid > 0) {
@@ -328,27 +751,91 @@ int main(int args, char* argv[]) {
     }
     // initialize the queue
     SLIST_INIT(&thread_list_head);
-    // init mutex
-    pthread_mutex_init(&mut, NULL);
+    // open the channel stores, channel 0 keeps the legacy path
+    for(int i = 0; i < num_channels; i++) {
+        char path[256];
+        if(i == 0) {
+            snprintf(path, sizeof(path), "%s", file_path);
+        } else {
+            snprintf(path, sizeof(path), "%s.%d", file_path, i);
+        }
+        if(store_open(&stores[i], path, format) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(budget_mode) {
+        if(slab_init(&node_pool, "connections", sizeof(struct thread_node), budget_conns, 0) < 0 ||
+                slab_init(&buffer_pool, "packet buffers", budget_packet, budget_conns, 0) < 0 ||
+                slab_init(&send_pool, "send buffers", STORE_SEND_CHUNK, budget_conns, 0) < 0 ||
+                slab_init(&stack_pool, "thread stacks", budget_stack, budget_conns, SLAB_STACK) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        // one buffer per replication stream: a follower runs one per channel,
+        // a primary as many as it accepts
+        size_t repl_buffers = follow_endpoint ? (size_t)num_channels : repl_endpoint ? REPL_MAX_PEERS : 0;
+        if(repl_buffers > 0 &&
+                slab_init(&repl_pool, "replication buffers", STORE_SEND_CHUNK, repl_buffers, 0) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_init(&service_attr);
+        pthread_attr_setstacksize(&service_attr, budget_stack);
+        syslog(LOG_INFO, "memory budget: %zu connections, %zu byte packets, %zu KiB stacks",
+                budget_conns, budget_packet, budget_stack / 1024);
+    }
+    if(trace_path && trace_open(trace_path) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    lockprof_install();
+    repl_init(stores, num_channels, &stop_requested, budget_mode ? &service_attr : NULL,
+            budget_mode ? &repl_pool : NULL);
+    if(follow_endpoint && repl_follow(follow_endpoint) < 0) {
+        syslog(LOG_ERR, "Error starting replication from %s", follow_endpoint);
+        exit(EXIT_FAILURE);
+    }
     // starting log thread
-    if(pthread_create(&time_log_thread, NULL, &log_time, NULL) != 0 ) {
+    if(pthread_create(&time_log_thread, budget_mode ? &service_attr : NULL, &log_time, NULL) != 0 ) {
         syslog(LOG_ERR, "Error while creating thread for time logging %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    if(udp_fd >= 0) {
+        startConnection(udp_fd, 0, datagram_thread);
+    }
 
-    // start listening on sock_fd and accept any incoming connection
-    if(listen(sock_fd, 5) < 0) {
-        syslog(LOG_ERR, " Error while trying to listen : %s\n", strerror(errno));
-        close(sock_fd);
-        sock_fd = -1;
-        exit(EXIT_FAILURE);
+    // start listening on every socket and accept any incoming connection
+    struct pollfd pfds[MAX_LISTENERS];
+    for(int i = 0; i < num_listeners; i++) {
+        if(listen(listeners[i].fd, LISTEN_BACKLOG) < 0) {
+            syslog(LOG_ERR, " Error while trying to listen : %s\n", strerror(errno));
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        pfds[i].fd = listeners[i].fd;
+        pfds[i].events = POLLIN;
     }
     int client_fd = -1;
     // start accepting connections
     while(!stop_requested) {
-        struct sockaddr sock_addr;
+        if(poll(pfds, num_listeners, -1) < 0) {
+            if (stop_requested || errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR,"poll error : %s", strerror(errno));
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        int ready = -1;
+        for(int i = 0; i < num_listeners; i++) {
+            if(pfds[i].revents) {
+                ready = i;
+                break;
+            }
+        }
+        if(ready < 0) {
+            continue;
+        }
+        struct sockaddr_storage sock_addr;
         socklen_t sock_len = sizeof(sock_addr);
-        client_fd = accept(sock_fd, &sock_addr, &sock_len);
+        client_fd = accept(listeners[ready].fd, (struct sockaddr *)&sock_addr, &sock_len);
         if(client_fd < 0) {
             if (stop_requested) {
                 break;
@@ -357,28 +844,25 @@ int main(int args, char* argv[]) {
             cleanup();
             exit(EXIT_FAILURE);
         }
+        if(listeners[ready].kind == LISTEN_REPLICATION) {
+            repl_serve_follower(client_fd);
+            continue;
+        }
         syslog(LOG_INFO,"listenAndAccept successfull\n");
-        char host[NI_MAXHOST], serv[NI_MAXSERV];
-
-        getnameinfo(&sock_addr, sock_len,
-                host, sizeof(host),
-                serv, sizeof(serv),
-                NI_NUMERICHOST | NI_NUMERICSERV);
-
-        syslog(LOG_INFO, "Accepted connection from %s:%s\n", host, serv);
-        struct thread_node *node = calloc(1, sizeof(*node));
-        node->completed = 0;
-        node->client_fd = client_fd;
-        //create thread for each connection
-        if(pthread_create(&node->thread_id, NULL, client_thread, node) != 0) {
-            syslog(LOG_ERR, "Thread creation failed %s\n",strerror(errno));
-            free(node);
-            close(client_fd);
+        if(sock_addr.ss_family == AF_UNIX) {
+            syslog(LOG_INFO, "Accepted local connection on %s\n", listeners[ready].path);
         } else {
-            SLIST_INSERT_HEAD(&thread_list_head, node, entries);
+            char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+            getnameinfo((struct sockaddr *)&sock_addr, sock_len,
+                    host, sizeof(host),
+                    serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+
+            syslog(LOG_INFO, "Accepted connection from %s:%s\n", host, serv);
         }
-    
-        // join threads which are completed to avoid memory leak
+        // join threads which are completed to avoid memory leak, and so
+        // their pool slots are free for this connection in budget mode
         struct thread_node *iter, *tmp;
         iter = SLIST_FIRST(&thread_list_head);
         while(iter != NULL) {
@@ -386,16 +870,23 @@ int main(int args, char* argv[]) {
             if(iter->completed) {
                  pthread_join(iter->thread_id, NULL);
                 SLIST_REMOVE(&thread_list_head, iter, thread_node, entries);
-                free(iter);
+                releaseNode(iter);
             }
             iter = tmp;
         }
+        startConnection(client_fd, listeners[ready].channel,
+                listeners[ready].kind == LISTEN_DATAGRAM ? datagram_thread : client_thread);
     }
     if (stop_requested) {
-        shutdown(client_fd, SHUT_RDWR);
+        // wake every client still blocked in recv so cleanup can join it
+        struct thread_node *iter;
+        SLIST_FOREACH(iter, &thread_list_head, entries) {
+            if(!iter->completed) {
+                shutdown(iter->client_fd, SHUT_RDWR);
+            }
+        }
     }
     //clean up before returning
-    close(client_fd);
     cleanup();
     return 0;
 }
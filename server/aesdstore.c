@@ -0,0 +1,736 @@
+/*
+ * aesdstore.c
+ *
+ * Text and indexed record storage for aesdsocket, see aesdstore.h.
+ */
+
+#define _GNU_SOURCE
+#include "aesdstore.h"
+#include "lockprof.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define SEND_IOV_MAX 64
+
+static int write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writev_fully(int fd, struct iovec *iov, int iovcnt)
+{
+    while(iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // skip the fully written vectors and trim the partial one
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send [off, off+len) of @param data_fd, in the kernel where possible.
+ * The userspace fallback copies through @param buf, or a heap buffer when NULL.
+ */
+static int send_file_range(int client_fd, int data_fd, uint64_t off, uint64_t len, char *buf)
+{
+    off_t pos = off;
+    char *heap = NULL;
+    while(len > 0) {
+        ssize_t n = sendfile(client_fd, data_fd, &pos, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // no sendfile for this pair, copy through userspace
+            if(!buf && !heap && (heap = malloc(STORE_SEND_CHUNK)) == NULL) {
+                return -1;
+            }
+            char *copy = buf ? buf : heap;
+            ssize_t r = pread(data_fd, copy, len < STORE_SEND_CHUNK ? len : STORE_SEND_CHUNK, pos);
+            if(r <= 0 || write_fully(client_fd, copy, r) < 0) {
+                free(heap);
+                return -1;
+            }
+            n = r;
+            pos += r;
+        } else if(n <= 0) {
+            free(heap);
+            return -1;
+        }
+        len -= n;
+    }
+    free(heap);
+    return 0;
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called with the lock held (or before the store is shared) */
+static int index_add(struct aesd_store *store, uint64_t record, uint64_t offset, uint64_t arrival_ns)
+{
+    if(store->index_len == store->index_cap) {
+        size_t cap = store->index_cap ? store->index_cap * 2 : 256;
+        struct index_entry *index = realloc(store->index, cap * sizeof(*index));
+        if(!index) {
+            syslog(LOG_ERR, "realloc error for index of %s", store->path);
+            return -1;
+        }
+        store->index = index;
+        store->index_cap = cap;
+    }
+    struct index_entry *e = &store->index[store->index_len++];
+    e->record = record;
+    e->offset = offset;
+    e->arrival_ns = arrival_ns;
+    if(store->index_fd >= 0 && write_fully(store->index_fd, e, sizeof(*e)) < 0) {
+        syslog(LOG_ERR, "Error writing index %s : %s", store->index_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Every field a writer sets to a fixed value, see store_append_batch() */
+static int header_valid(const struct record_header *hdr)
+{
+    return (hdr->type == RECORD_PACKET || hdr->type == RECORD_TIMESTAMP) &&
+        hdr->flags == 0 && hdr->reserved == 0;
+}
+
+/*
+ * Load "<path>.idx" written by an earlier run and check every entry against
+ * the data file, so a stale or foreign index is never trusted.
+ * @return 0 with the index loaded, -1 (index left empty) if it is missing or invalid
+ */
+static int load_index(struct aesd_store *store)
+{
+    int fd = open(store->index_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    size_t count = 0;
+    if(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size % sizeof(struct index_entry) == 0) {
+        count = st.st_size / sizeof(struct index_entry);
+        store->index = malloc(st.st_size);
+        if(store->index && pread(fd, store->index, st.st_size, 0) != st.st_size) {
+            free(store->index);
+            store->index = NULL;
+        }
+    }
+    close(fd);
+    if(!store->index) {
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        struct index_entry *e = &store->index[i];
+        struct record_header hdr;
+        if(e->record != i * STORE_INDEX_INTERVAL ||
+                e->offset + sizeof(hdr) > store->size ||
+                (i > 0 && (e->offset <= e[-1].offset || e->arrival_ns < e[-1].arrival_ns)) ||
+                pread(store->fd, &hdr, sizeof(hdr), e->offset) != sizeof(hdr) ||
+                !header_valid(&hdr) || hdr.arrival_ns != e->arrival_ns) {
+            syslog(LOG_WARNING, "%s: index entry %zu does not match the data file, rescanning",
+                    store->index_path, i);
+            free(store->index);
+            store->index = NULL;
+            return -1;
+        }
+    }
+    store->index_len = store->index_cap = count;
+    return 0;
+}
+
+/*
+ * Index the records from the last index entry (or the start of the data
+ * file) to its end.  A partially written record after a valid prefix, left
+ * by a crash during an append, is dropped.  Anything else that does not
+ * parse means this is not a record file: it is left untouched and -1 returned.
+ */
+static int rebuild_index(struct aesd_store *store)
+{
+    uint64_t off = 0;
+    store->records = 0;
+    store->last_arrival_ns = 0;
+    if(store->index_len > 0) {
+        struct index_entry *last = &store->index[store->index_len - 1];
+        off = last->offset;
+        store->records = last->record;
+        store->last_arrival_ns = last->arrival_ns;
+    }
+    struct record_header hdr;
+    while(off + sizeof(hdr) <= store->size) {
+        if(pread(store->fd, &hdr, sizeof(hdr), off) != sizeof(hdr)) {
+            syslog(LOG_ERR, "Error reading %s : %s", store->path, strerror(errno));
+            return -1;
+        }
+        if(!header_valid(&hdr)) {
+            syslog(LOG_ERR, "%s: invalid record header at offset %llu, not opening it as a record store",
+                    store->path, (unsigned long long)off);
+            return -1;
+        }
+        if(hdr.length > store->size - off - sizeof(hdr)) {
+            // torn payload
+            break;
+        }
+        int indexed = store->index_len > 0 && store->index[store->index_len - 1].record == store->records;
+        if(store->records % STORE_INDEX_INTERVAL == 0 && !indexed &&
+                index_add(store, store->records, off, hdr.arrival_ns) < 0) {
+            return -1;
+        }
+        store->records++;
+        store->last_arrival_ns = hdr.arrival_ns;
+        off += sizeof(hdr) + hdr.length;
+    }
+    if(off != store->size) {
+        if(off == 0) {
+            // a torn first record would still have a valid header
+            syslog(LOG_ERR, "%s: no complete record header, not opening it as a record store", store->path);
+            return -1;
+        }
+        syslog(LOG_WARNING, "%s: dropping %llu bytes of a torn trailing record",
+                store->path, (unsigned long long)(store->size - off));
+        if(ftruncate(store->fd, off) < 0) {
+            syslog(LOG_ERR, "ftruncate error %s : %s", store->path, strerror(errno));
+            return -1;
+        }
+        store->size = off;
+    }
+    return 0;
+}
+
+int store_open(struct aesd_store *store, const char *path, enum store_format format)
+{
+    memset(store, 0, sizeof(*store));
+    store->format = format;
+    store->fd = -1;
+    store->index_fd = -1;
+    store->path = strdup(path);
+    if(!store->path) {
+        return -1;
+    }
+    store->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(store->fd < 0) {
+        syslog(LOG_ERR, "Error opening file %s : %s", path, strerror(errno));
+        goto fail;
+    }
+    // a second process appending, truncating or deleting the file would corrupt it
+    if(flock(store->fd, LOCK_EX | LOCK_NB) < 0) {
+        syslog(LOG_ERR, "Error locking file %s : %s", path,
+                errno == EWOULDBLOCK ? "in use by another process" : strerror(errno));
+        goto fail;
+    }
+    struct stat st;
+    if(fstat(store->fd, &st) < 0) {
+        syslog(LOG_ERR, "fstat error %s : %s", path, strerror(errno));
+        goto fail;
+    }
+    store->size = st.st_size;
+
+    if(format == STORE_FORMAT_RECORD) {
+        if(asprintf(&store->index_path, "%s.idx", path) < 0) {
+            store->index_path = NULL;
+            goto fail;
+        }
+        // start from the saved index, only the records after it are scanned
+        load_index(store);
+        if(rebuild_index(store) < 0) {
+            goto fail;
+        }
+        store->index_fd = open(store->index_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(store->index_fd < 0) {
+            syslog(LOG_ERR, "Error opening file %s : %s", store->index_path, strerror(errno));
+            goto fail;
+        }
+        if(write_fully(store->index_fd, store->index, store->index_len * sizeof(*store->index)) < 0) {
+            syslog(LOG_ERR, "Error writing index %s : %s", store->index_path, strerror(errno));
+            goto fail;
+        }
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->grown, &attr);
+    pthread_cond_init(&store->resync, &attr);
+    pthread_condattr_destroy(&attr);
+    lockprof_name(&store->lock, store->path);
+    return 0;
+
+fail:
+    if(store->fd >= 0) {
+        close(store->fd);
+    }
+    if(store->index_fd >= 0) {
+        close(store->index_fd);
+    }
+    free(store->index);
+    free(store->index_path);
+    free(store->path);
+    memset(store, 0, sizeof(*store));
+    store->fd = store->index_fd = -1;
+    return -1;
+}
+
+void store_close(struct aesd_store *store, int remove_files)
+{
+    if(store->path == NULL) {
+        return;
+    }
+    close(store->fd);
+    if(store->index_fd >= 0) {
+        close(store->index_fd);
+    }
+    if(remove_files) {
+        remove(store->path);
+        if(store->index_path) {
+            remove(store->index_path);
+        }
+    }
+    pthread_cond_destroy(&store->grown);
+    pthread_cond_destroy(&store->resync);
+    pthread_mutex_destroy(&store->lock);
+    free(store->index);
+    free(store->index_path);
+    free(store->path);
+    memset(store, 0, sizeof(*store));
+    store->fd = store->index_fd = -1;
+}
+
+int store_append(struct aesd_store *store, enum record_type type, uint32_t conn_id,
+        const char *buf, size_t len)
+{
+    struct iovec packet = { .iov_base = (void *)buf, .iov_len = len };
+    return store_append_batch(store, type, conn_id, &packet, 1);
+}
+
+/* Write up to STORE_BATCH_MAX records with one writev, store lock held */
+static int append_chunk(struct aesd_store *store, enum record_type type, uint32_t conn_id,
+        const struct iovec *packets, int count)
+{
+    struct iovec iov[2 * STORE_BATCH_MAX];
+    struct record_header hdr[STORE_BATCH_MAX];
+    uint64_t bytes = 0;
+    int iovcnt = 0;
+    uint64_t now = 0;
+
+    if(store->format == STORE_FORMAT_RECORD) {
+        now = realtime_ns();
+        if(now < store->last_arrival_ns) {
+            // keep arrival times sorted for store_seek_time() across clock steps
+            now = store->last_arrival_ns;
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(store->format == STORE_FORMAT_RECORD) {
+            hdr[i] = (struct record_header) {
+                .length = packets[i].iov_len,
+                .type = type,
+                .conn_id = conn_id,
+                .arrival_ns = now,
+            };
+            iov[iovcnt].iov_base = &hdr[i];
+            iov[iovcnt++].iov_len = sizeof(hdr[i]);
+            bytes += sizeof(hdr[i]);
+        }
+        iov[iovcnt++] = packets[i];
+        bytes += packets[i].iov_len;
+    }
+    if(writev_fully(store->fd, iov, iovcnt) < 0) {
+        // never leave a torn record behind
+        if(store->format == STORE_FORMAT_RECORD && ftruncate(store->fd, store->size) < 0) {
+            syslog(LOG_ERR, "ftruncate error %s : %s", store->path, strerror(errno));
+        }
+        return -1;
+    }
+    if(store->format == STORE_FORMAT_RECORD) {
+        uint64_t offset = store->size;
+        for(int i = 0; i < count; i++) {
+            if(store->records % STORE_INDEX_INTERVAL == 0) {
+                index_add(store, store->records, offset, now);
+            }
+            store->records++;
+            offset += sizeof(hdr[i]) + packets[i].iov_len;
+        }
+        store->last_arrival_ns = now;
+    }
+    store->size += bytes;
+    return 0;
+}
+
+int store_append_batch(struct aesd_store *store, enum record_type type, uint32_t conn_id,
+        const struct iovec *packets, int count)
+{
+    int rc = 0;
+    PROF_MUTEX_LOCK(&store->lock);
+    for(int done = 0; done < count && rc == 0; done += STORE_BATCH_MAX) {
+        int n = count - done < STORE_BATCH_MAX ? count - done : STORE_BATCH_MAX;
+        rc = append_chunk(store, type, conn_id, packets + done, n);
+    }
+    if(rc < 0) {
+        syslog(LOG_ERR, "Error writing to file %s : %s", store->path, strerror(errno));
+    } else {
+        pthread_cond_broadcast(&store->grown);
+    }
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return rc;
+}
+
+uint64_t store_wait_size(struct aesd_store *store, uint64_t known, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    PROF_MUTEX_LOCK(&store->lock);
+    while(store->size <= known) {
+        if(PROF_COND_TIMEDWAIT(&store->grown, &store->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    uint64_t size = store->size;
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return size;
+}
+
+int store_write_raw(struct aesd_store *store, const char *buf, size_t len)
+{
+    // only the replication thread writes to a replica, readers stop at size
+    if(write_fully(store->fd, buf, len) < 0) {
+        syslog(LOG_ERR, "Error writing to file %s : %s", store->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int store_commit(struct aesd_store *store)
+{
+    struct stat st;
+    if(fstat(store->fd, &st) < 0) {
+        syslog(LOG_ERR, "fstat error %s : %s", store->path, strerror(errno));
+        return -1;
+    }
+    int rc = 0;
+    PROF_MUTEX_LOCK(&store->lock);
+    uint64_t old_size = store->size;
+    if(store->format == STORE_FORMAT_RECORD) {
+        // index the records that just became visible
+        uint64_t off = store->size;
+        store->size = st.st_size;
+        struct record_header hdr;
+        while(off + sizeof(hdr) <= store->size &&
+                pread(store->fd, &hdr, sizeof(hdr), off) == sizeof(hdr) &&
+                hdr.length <= store->size - off - sizeof(hdr)) {
+            if(store->records % STORE_INDEX_INTERVAL == 0) {
+                index_add(store, store->records, off, hdr.arrival_ns);
+            }
+            store->records++;
+            store->last_arrival_ns = hdr.arrival_ns;
+            off += sizeof(hdr) + hdr.length;
+        }
+        if(off != store->size) {
+            syslog(LOG_ERR, "%s: replicated data does not end on a record boundary", store->path);
+            store->size = off;
+            rc = -1;
+        }
+    } else {
+        store->size = st.st_size;
+    }
+    if(store->size > old_size) {
+        pthread_cond_broadcast(&store->grown);
+    }
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return rc;
+}
+
+int store_truncate(struct aesd_store *store, uint64_t offset)
+{
+    int rc = 0;
+    PROF_MUTEX_LOCK(&store->lock);
+    if(offset < store->size) {
+        // committed bytes are about to be rewritten, let current senders finish
+        store->truncating = 1;
+        while(store->readers > 0) {
+            PROF_COND_WAIT(&store->resync, &store->lock);
+        }
+    }
+    if(ftruncate(store->fd, offset) < 0) {
+        syslog(LOG_ERR, "ftruncate error %s : %s", store->path, strerror(errno));
+        rc = -1;
+    } else if(offset == store->size) {
+        // only uncommitted replica bytes were dropped, the index is still valid
+    } else {
+        store->size = offset;
+        if(store->format == STORE_FORMAT_RECORD) {
+            // keep the index below the new end and rescan from its last entry
+            while(store->index_len > 0 && store->index[store->index_len - 1].offset >= offset) {
+                store->index_len--;
+            }
+            off_t index_size = store->index_len * sizeof(*store->index);
+            if(store->index_fd >= 0 &&
+                    (ftruncate(store->index_fd, index_size) < 0 ||
+                     lseek(store->index_fd, index_size, SEEK_SET) < 0)) {
+                syslog(LOG_ERR, "ftruncate error %s : %s", store->index_path, strerror(errno));
+            }
+            rc = rebuild_index(store);
+        }
+    }
+    if(store->truncating) {
+        store->truncating = 0;
+        pthread_cond_broadcast(&store->resync);
+    }
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return rc;
+}
+
+/* Register an unlocked reader of the data file, @return the committed size */
+static uint64_t reader_enter(struct aesd_store *store)
+{
+    PROF_MUTEX_LOCK(&store->lock);
+    while(store->truncating) {
+        PROF_COND_WAIT(&store->resync, &store->lock);
+    }
+    store->readers++;
+    uint64_t size = store->size;
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return size;
+}
+
+static void reader_exit(struct aesd_store *store)
+{
+    PROF_MUTEX_LOCK(&store->lock);
+    if(--store->readers == 0 && store->truncating) {
+        pthread_cond_broadcast(&store->resync);
+    }
+    PROF_MUTEX_UNLOCK(&store->lock);
+}
+
+/* Stream the payloads of the records in [start, end) through @param chunk of STORE_SEND_CHUNK bytes */
+static int send_records_chunked(struct aesd_store *store, int client_fd, uint64_t start, uint64_t end,
+        char *chunk)
+{
+    uint64_t off = start;
+    while(off < end) {
+        size_t want = end - off < STORE_SEND_CHUNK ? end - off : STORE_SEND_CHUNK;
+        ssize_t n = pread(store->fd, chunk, want, off);
+        if(n < (ssize_t)sizeof(struct record_header)) {
+            syslog(LOG_ERR, "Error reading %s at %llu", store->path, (unsigned long long)off);
+            return -1;
+        }
+        struct iovec iov[SEND_IOV_MAX];
+        int iovcnt = 0;
+        size_t pos = 0;
+        while(pos + sizeof(struct record_header) <= (size_t)n) {
+            struct record_header hdr;
+            memcpy(&hdr, chunk + pos, sizeof(hdr));
+            size_t rec_len = sizeof(hdr) + hdr.length;
+            if(pos + rec_len > (size_t)n) {
+                if(pos == 0) {
+                    // payload larger than the chunk, send it straight from the file
+                    if(off + rec_len > end ||
+                            send_file_range(client_fd, store->fd, off + sizeof(hdr), hdr.length, chunk) < 0) {
+                        return -1;
+                    }
+                    pos = rec_len;
+                }
+                break;
+            }
+            if(hdr.length > 0) {
+                iov[iovcnt].iov_base = chunk + pos + sizeof(hdr);
+                iov[iovcnt].iov_len = hdr.length;
+                iovcnt++;
+            }
+            pos += rec_len;
+            if(iovcnt == SEND_IOV_MAX) {
+                if(writev_fully(client_fd, iov, iovcnt) < 0) {
+                    return -1;
+                }
+                iovcnt = 0;
+            }
+        }
+        if(iovcnt > 0 && writev_fully(client_fd, iov, iovcnt) < 0) {
+            return -1;
+        }
+        if(pos == 0) {
+            syslog(LOG_ERR, "Corrupt record in %s at %llu", store->path, (unsigned long long)off);
+            return -1;
+        }
+        off += pos;
+    }
+    return 0;
+}
+
+/* Without a caller buffer the chunk is heap allocated, budget mode threads run on small stacks */
+static int send_records(struct aesd_store *store, int client_fd, uint64_t start, uint64_t end, char *buf)
+{
+    if(buf) {
+        return send_records_chunked(store, client_fd, start, end, buf);
+    }
+    char *chunk = malloc(STORE_SEND_CHUNK);
+    if(!chunk) {
+        syslog(LOG_ERR, "malloc error %s", strerror(errno));
+        return -1;
+    }
+    int rc = send_records_chunked(store, client_fd, start, end, chunk);
+    free(chunk);
+    return rc;
+}
+
+int store_send_range(struct aesd_store *store, int client_fd, uint64_t start, uint64_t end, char *buf)
+{
+    // appends never rewrite bytes below size and truncates wait for us,
+    // so this snapshot stays valid unlocked
+    uint64_t size = reader_enter(store);
+    if(end == 0 || end > size) {
+        end = size;
+    }
+    int rc = 0;
+    if(start < end) {
+        rc = store->format == STORE_FORMAT_TEXT ?
+            send_file_range(client_fd, store->fd, start, end - start, buf) :
+            send_records(store, client_fd, start, end, buf);
+    }
+    reader_exit(store);
+    if(rc < 0) {
+        syslog(LOG_ERR, "Error while sending the data to client %s", strerror(errno));
+    }
+    return rc;
+}
+
+int store_send_all(struct aesd_store *store, int client_fd, char *buf)
+{
+    return store_send_range(store, client_fd, 0, 0, buf);
+}
+
+int store_send_raw(struct aesd_store *store, int fd, uint64_t start, uint64_t end, char *buf)
+{
+    if(start >= end) {
+        return 0;
+    }
+    reader_enter(store);
+    int rc = send_file_range(fd, store->fd, start, end - start, buf);
+    reader_exit(store);
+    return rc;
+}
+
+/* Index slot of the last entry whose key is <= @param key, -1 if none; called locked */
+static long index_search(struct aesd_store *store, uint64_t key, int by_time)
+{
+    long lo = 0, hi = (long)store->index_len - 1, found = -1;
+    while(lo <= hi) {
+        long mid = lo + (hi - lo) / 2;
+        uint64_t v = by_time ? store->index[mid].arrival_ns : store->index[mid].record;
+        if(v <= key) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+int store_seek_record(struct aesd_store *store, uint64_t record, uint64_t *offset)
+{
+    if(store->format != STORE_FORMAT_RECORD) {
+        return -1;
+    }
+    int rc = 0;
+    PROF_MUTEX_LOCK(&store->lock);
+    if(record > store->records) {
+        rc = -1;
+    } else if(record == store->records) {
+        *offset = store->size;
+    } else {
+        long slot = index_search(store, record, 0);
+        uint64_t cur = store->index[slot].record;
+        uint64_t off = store->index[slot].offset;
+        // at most STORE_INDEX_INTERVAL - 1 headers to skip
+        while(cur < record) {
+            struct record_header hdr;
+            if(pread(store->fd, &hdr, sizeof(hdr), off) != sizeof(hdr)) {
+                rc = -1;
+                break;
+            }
+            off += sizeof(hdr) + hdr.length;
+            cur++;
+        }
+        *offset = off;
+    }
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return rc;
+}
+
+int store_seek_time(struct aesd_store *store, uint64_t arrival_ns, uint64_t *record, uint64_t *offset)
+{
+    if(store->format != STORE_FORMAT_RECORD) {
+        return -1;
+    }
+    int rc = 0;
+    PROF_MUTEX_LOCK(&store->lock);
+    // start from the last indexed record strictly before arrival_ns
+    long slot = arrival_ns ? index_search(store, arrival_ns - 1, 1) : -1;
+    uint64_t cur = slot < 0 ? 0 : store->index[slot].record;
+    uint64_t off = slot < 0 ? 0 : store->index[slot].offset;
+    while(cur < store->records) {
+        struct record_header hdr;
+        if(pread(store->fd, &hdr, sizeof(hdr), off) != sizeof(hdr)) {
+            rc = -1;
+            break;
+        }
+        if(hdr.arrival_ns >= arrival_ns) {
+            break;
+        }
+        off += sizeof(hdr) + hdr.length;
+        cur++;
+    }
+    *record = cur;
+    *offset = off;
+    PROF_MUTEX_UNLOCK(&store->lock);
+    return rc;
+}
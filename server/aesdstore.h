@@ -0,0 +1,174 @@
+/*
+ * aesdstore.h
+ *
+ * Append-only store behind aesdsocket.
+ *
+ * STORE_FORMAT_TEXT is the legacy layout: packets and timestamp lines are
+ * appended to the data file as raw text.
+ *
+ * STORE_FORMAT_RECORD prefixes every append with a struct record_header and
+ * keeps a sparse index (one entry every STORE_INDEX_INTERVAL records) in
+ * memory and in "<path>.idx", so a record number or an arrival time can be
+ * located with a binary search plus a short forward scan.  Replay streams
+ * just the payloads, so clients see exactly the bytes the text format gives.
+ */
+
+#ifndef AESDSTORE_H
+#define AESDSTORE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define STORE_INDEX_INTERVAL 64
+/* records written per writev() by store_append_batch() */
+#define STORE_BATCH_MAX 32
+/* size of the copy buffer the store_send functions take */
+#define STORE_SEND_CHUNK 65536
+
+enum store_format {
+    STORE_FORMAT_TEXT,
+    STORE_FORMAT_RECORD,
+};
+
+enum record_type {
+    RECORD_PACKET = 1,
+    RECORD_TIMESTAMP = 2,
+};
+
+/* on-disk header of every record, native byte order */
+struct record_header {
+    uint32_t length;        /* payload bytes following the header */
+    uint16_t type;          /* enum record_type */
+    uint16_t flags;
+    uint32_t conn_id;       /* 0 for records not tied to a connection */
+    uint32_t reserved;
+    uint64_t arrival_ns;    /* CLOCK_REALTIME, never decreasing within a store */
+};
+
+/* one sparse index entry, also the layout of the .idx file */
+struct index_entry {
+    uint64_t record;
+    uint64_t offset;
+    uint64_t arrival_ns;
+};
+
+struct aesd_store {
+    pthread_mutex_t lock;
+    /* broadcast whenever size grows */
+    pthread_cond_t grown;
+    /* senders reading the data file unlocked, store_truncate() waits for 0 */
+    unsigned readers;
+    /* set while store_truncate() rewrites the file, new senders wait */
+    int truncating;
+    /* broadcast when readers drops to 0 or a truncate finishes */
+    pthread_cond_t resync;
+    enum store_format format;
+    char *path;
+    char *index_path;
+    int fd;
+    int index_fd;
+    /* bytes in the data file */
+    uint64_t size;
+    /* records in the data file, record format only */
+    uint64_t records;
+    uint64_t last_arrival_ns;
+    struct index_entry *index;
+    size_t index_len;
+    size_t index_cap;
+};
+
+/**
+ * Open or create the store at @param path.  For an existing record file
+ * the saved "<path>.idx" is validated against the data and only the records
+ * after its last entry are scanned (the whole file if the index is missing or
+ * stale).  A torn trailing record is dropped; a file that does not start with
+ * a valid record is refused and left untouched.  The data file is locked
+ * with flock() until store_close(), so a store already open in another
+ * process is refused too.
+ * @return 0 on success, -1 on error (logged to syslog)
+ */
+int store_open(struct aesd_store *store, const char *path, enum store_format format);
+
+/**
+ * Close the store, deleting its files when @param remove_files is set.
+ */
+void store_close(struct aesd_store *store, int remove_files);
+
+/**
+ * Append @param len bytes of @param buf as one record.
+ * @return 0 on success, -1 on error
+ */
+int store_append(struct aesd_store *store, enum record_type type, uint32_t conn_id,
+        const char *buf, size_t len);
+
+/**
+ * Append each of the @param count buffers in @param packets as its own
+ * record, taking the store lock once and writing STORE_BATCH_MAX records per
+ * writev().  Records in one batch share an arrival time.
+ * @return 0 on success, -1 on error
+ */
+int store_append_batch(struct aesd_store *store, enum record_type type, uint32_t conn_id,
+        const struct iovec *packets, int count);
+
+/**
+ * Send the payloads stored between data file offsets @param start and
+ * @param end to @param client_fd.  An @param end of 0 means the end of the
+ * store when the call is made.  The store lock is only held to take that
+ * snapshot, not while sending; a concurrent store_truncate() waits for the
+ * send to finish, and a send started during one waits for it.
+ * @param buf STORE_SEND_CHUNK bytes to copy through where the kernel cannot
+ * send straight from the file, NULL to allocate them for this call
+ * @return 0 on success, -1 on error
+ */
+int store_send_range(struct aesd_store *store, int client_fd, uint64_t start, uint64_t end, char *buf);
+
+/**
+ * Send the whole store to @param client_fd, the legacy echo.
+ */
+int store_send_all(struct aesd_store *store, int client_fd, char *buf);
+
+/**
+ * Send the data file bytes between @param start and @param end verbatim,
+ * headers included, as replication needs them.  @param buf as for
+ * store_send_range().
+ */
+int store_send_raw(struct aesd_store *store, int fd, uint64_t start, uint64_t end, char *buf);
+
+/**
+ * Find the data file offset of record number @param record (0 based); the
+ * end of the store if @param record equals the record count.
+ * @return 0 on success, -1 if out of range or not in record format
+ */
+int store_seek_record(struct aesd_store *store, uint64_t record, uint64_t *offset);
+
+/**
+ * Find the first record that arrived at or after @param arrival_ns.
+ * @return 0 on success with @param record and @param offset set (to the
+ * record count and end of store if there is none), -1 if not in record format
+ */
+int store_seek_time(struct aesd_store *store, uint64_t arrival_ns, uint64_t *record, uint64_t *offset);
+
+/**
+ * Wait up to @param timeout_ms for the store to grow beyond @param known bytes.
+ * @return the current size in bytes
+ */
+uint64_t store_wait_size(struct aesd_store *store, uint64_t known, int timeout_ms);
+
+/*
+ * Replica support: a follower writes the primary's bytes verbatim with
+ * store_write_raw() and makes them visible with store_commit() once a whole
+ * frame, which always ends on a record boundary, has been written.
+ */
+int store_write_raw(struct aesd_store *store, const char *buf, size_t len);
+int store_commit(struct aesd_store *store);
+
+/**
+ * Drop everything after @param offset, used when a replica is ahead of its
+ * primary or holds a partially received frame.  Committed bytes are only
+ * dropped once no store_send_range() is reading them.
+ */
+int store_truncate(struct aesd_store *store, uint64_t offset);
+
+#endif /* AESDSTORE_H */
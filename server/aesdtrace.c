@@ -0,0 +1,92 @@
+/*
+ * aesdtrace.c
+ *
+ * Session trace capture for aesdsocket, see aesdtrace.h.
+ */
+
+#include "aesdtrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static uint64_t trace_start_ns;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int trace_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        syslog(LOG_ERR, "Error opening trace %s : %s", path, strerror(errno));
+        return -1;
+    }
+    struct trace_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        syslog(LOG_ERR, "Error writing trace %s : %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    trace_start_ns = clock_ns(CLOCK_MONOTONIC);
+    trace_fd = fd;
+    return 0;
+}
+
+void trace_record(uint32_t conn_id, enum trace_kind kind, uint16_t channel,
+        const void *data, size_t len)
+{
+    if(trace_fd < 0) {
+        return;
+    }
+    struct trace_event ev = {
+        .conn_id = conn_id,
+        .kind = kind,
+        .channel = channel,
+        .length = len,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &ev, .iov_len = sizeof(ev) },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    // timestamp under the lock so events are written in time order
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    ev.time_ns = clock_ns(CLOCK_MONOTONIC) - trace_start_ns;
+    ssize_t n = writev(trace_fd, iov, 2);
+    if(n != (ssize_t)(sizeof(ev) + len)) {
+        // a short write would corrupt every later event, stop capturing
+        syslog(LOG_ERR, "Error writing trace, capture stopped : %s",
+                n < 0 ? strerror(errno) : "short write");
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_close(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,59 @@
+/*
+ * aesdtrace.h
+ *
+ * Session traces written by "aesdsocket -T <file>" and replayed by aesdreplay.
+ *
+ * The file starts with a struct trace_file_header followed by events, each a
+ * struct trace_event followed by length bytes of data, native byte order.
+ * Every stream connection contributes a TRACE_OPEN, one TRACE_DATA per
+ * recv() with exactly the bytes received, and a TRACE_CLOSE.  Times are
+ * CLOCK_MONOTONIC nanoseconds since the trace was opened.
+ */
+
+#ifndef AESDTRACE_H
+#define AESDTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "AESDTRC1"
+
+enum trace_kind {
+    TRACE_OPEN = 1,
+    TRACE_DATA = 2,
+    TRACE_CLOSE = 3,
+};
+
+struct trace_file_header {
+    char magic[8];
+    /* CLOCK_REALTIME at capture start, for reference only */
+    uint64_t start_realtime_ns;
+};
+
+struct trace_event {
+    uint64_t time_ns;
+    uint32_t conn_id;
+    uint16_t kind;          /* enum trace_kind */
+    uint16_t channel;       /* listener channel the connection arrived on */
+    uint32_t length;        /* data bytes following, TRACE_DATA only */
+    uint32_t reserved;
+};
+
+/**
+ * Start capturing to @param path, truncating it.
+ * @return 0 on success, -1 on error (logged to syslog)
+ */
+int trace_open(const char *path);
+
+/**
+ * Append one event; does nothing unless a trace is open.
+ */
+void trace_record(uint32_t conn_id, enum trace_kind kind, uint16_t channel,
+        const void *data, size_t len);
+
+/**
+ * Stop capturing and close the trace file.
+ */
+void trace_close(void);
+
+#endif /* AESDTRACE_H */
@@ -0,0 +1,328 @@
+/*
+ * lockprof.c
+ *
+ * Contention profiling for pthread mutexes, see lockprof.h.
+ *
+ * Statistics live in a fixed open-addressed table keyed by the mutex
+ * address, so any existing pthread_mutex_t can be profiled without changing
+ * its type.  A slot is only written while its mutex is held, which keeps
+ * the hot path free of atomics apart from the one-time slot claim.
+ */
+
+#define _GNU_SOURCE
+#include "lockprof.h"
+
+#ifdef AESD_LOCK_PROFILE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOCKPROF_MAX_LOCKS 64
+#define LOCKPROF_MAX_SITES 8
+#define LOCKPROF_REPORT_SITES 5
+#define LOCKPROF_NAME_MAX 64
+#define LOCKPROF_BUCKETS 40 /* log2(ns) buckets, last one catches everything above ~9 minutes */
+
+struct lockprof_site {
+    const char *site;
+    unsigned long contended;
+    unsigned long long wait_ns;
+};
+
+struct lockprof_stats {
+    _Atomic(pthread_mutex_t *) key;
+    /* copied, the report may run after the owner freed its name */
+    char name[LOCKPROF_NAME_MAX];
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long long wait_ns_total;
+    unsigned long long wait_ns_max;
+    unsigned long long hold_ns_total;
+    unsigned long long hold_ns_max;
+    unsigned long wait_hist[LOCKPROF_BUCKETS];
+    unsigned long hold_hist[LOCKPROF_BUCKETS];
+    unsigned long long hold_start;
+    struct lockprof_site sites[LOCKPROF_MAX_SITES];
+};
+
+static struct lockprof_stats lock_table[LOCKPROF_MAX_LOCKS];
+/* SIGUSR1 writes a byte here to wake the reporter thread */
+static int report_pipe[2] = {-1, -1};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long ns)
+{
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < LOCKPROF_BUCKETS ? bucket : LOCKPROF_BUCKETS - 1;
+}
+
+/* Find or claim the slot of @param mutex, NULL if the table is full */
+static struct lockprof_stats *lookup(pthread_mutex_t *mutex)
+{
+    uintptr_t h = ((uintptr_t)mutex >> 4) * 0x9E3779B97F4A7C15ULL;
+    for(int i = 0; i < LOCKPROF_MAX_LOCKS; i++) {
+        struct lockprof_stats *s = &lock_table[(h + i) % LOCKPROF_MAX_LOCKS];
+        pthread_mutex_t *key = atomic_load_explicit(&s->key, memory_order_acquire);
+        if(key == mutex) {
+            return s;
+        }
+        if(key == NULL) {
+            pthread_mutex_t *expected = NULL;
+            if(atomic_compare_exchange_strong(&s->key, &expected, mutex) || expected == mutex) {
+                return s;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Account a contended acquisition to @param site, evicting the quietest entry when full */
+static void record_site(struct lockprof_stats *s, const char *site, unsigned long long wait)
+{
+    struct lockprof_site *victim = &s->sites[0];
+    for(int i = 0; i < LOCKPROF_MAX_SITES; i++) {
+        struct lockprof_site *e = &s->sites[i];
+        if(e->site == site || e->site == NULL) {
+            victim = e;
+            break;
+        }
+        if(e->contended < victim->contended) {
+            victim = e;
+        }
+    }
+    if(victim->site != site) {
+        victim->site = site;
+        victim->contended = 0;
+        victim->wait_ns = 0;
+    }
+    victim->contended++;
+    victim->wait_ns += wait;
+}
+
+/* Called with @param mutex held */
+static void record_acquire(pthread_mutex_t *mutex, const char *site,
+        bool contended, unsigned long long start, unsigned long long acquired)
+{
+    struct lockprof_stats *s = lookup(mutex);
+    if(!s) {
+        return;
+    }
+    unsigned long long wait = acquired - start;
+    s->acquisitions++;
+    s->wait_ns_total += wait;
+    if(wait > s->wait_ns_max) {
+        s->wait_ns_max = wait;
+    }
+    s->wait_hist[bucket_of(wait)]++;
+    if(contended) {
+        s->contended++;
+        record_site(s, site, wait);
+    }
+    s->hold_start = acquired;
+}
+
+int lockprof_lock(pthread_mutex_t *mutex, const char *site)
+{
+    unsigned long long start = now_ns();
+    int rc = pthread_mutex_trylock(mutex);
+    bool contended = false;
+    if(rc == EBUSY) {
+        contended = true;
+        rc = pthread_mutex_lock(mutex);
+    }
+    if(rc != 0) {
+        return rc;
+    }
+    record_acquire(mutex, site, contended, start, contended ? now_ns() : start);
+    return 0;
+}
+
+int lockprof_trylock(pthread_mutex_t *mutex, const char *site)
+{
+    int rc = pthread_mutex_trylock(mutex);
+    if(rc == 0) {
+        unsigned long long now = now_ns();
+        record_acquire(mutex, site, false, now, now);
+    }
+    return rc;
+}
+
+/* Called with @param mutex held, ends the current hold */
+static struct lockprof_stats *record_release(pthread_mutex_t *mutex)
+{
+    struct lockprof_stats *s = lookup(mutex);
+    if(s && s->hold_start) {
+        unsigned long long hold = now_ns() - s->hold_start;
+        s->hold_start = 0;
+        s->hold_ns_total += hold;
+        if(hold > s->hold_ns_max) {
+            s->hold_ns_max = hold;
+        }
+        s->hold_hist[bucket_of(hold)]++;
+    }
+    return s;
+}
+
+int lockprof_unlock(pthread_mutex_t *mutex)
+{
+    record_release(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+int lockprof_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+        const struct timespec *abstime)
+{
+    // the mutex is released while waiting, so that time is not held time
+    struct lockprof_stats *s = record_release(mutex);
+    int rc = abstime ? pthread_cond_timedwait(cond, mutex, abstime)
+            : pthread_cond_wait(cond, mutex);
+    if(s) {
+        s->hold_start = now_ns();
+    }
+    return rc;
+}
+
+void lockprof_name(pthread_mutex_t *mutex, const char *name)
+{
+    struct lockprof_stats *s = lookup(mutex);
+    if(s) {
+        snprintf(s->name, sizeof(s->name), "%s", name);
+    }
+}
+
+static void log_histogram(const char *label, const unsigned long *hist)
+{
+    char line[512];
+    size_t used = 0;
+    for(int b = 0; b < LOCKPROF_BUCKETS && used < sizeof(line); b++) {
+        if(hist[b] == 0) {
+            continue;
+        }
+        // bucket b holds values in [2^(b-1), 2^b) ns
+        unsigned long long upper = 1ULL << b;
+        int n;
+        if(upper < 10000) {
+            n = snprintf(line + used, sizeof(line) - used, " <%lluns:%lu", upper, hist[b]);
+        } else if(upper < 10000000) {
+            n = snprintf(line + used, sizeof(line) - used, " <%lluus:%lu", upper / 1000, hist[b]);
+        } else {
+            n = snprintf(line + used, sizeof(line) - used, " <%llums:%lu", upper / 1000000, hist[b]);
+        }
+        if(n < 0) {
+            break;
+        }
+        used += n;
+    }
+    syslog(LOG_INFO, "lockprof   %s:%s", label, used ? line : " none");
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const struct lockprof_site *sa = a, *sb = b;
+    return (sb->contended > sa->contended) - (sb->contended < sa->contended);
+}
+
+void lockprof_dump(void)
+{
+    for(int i = 0; i < LOCKPROF_MAX_LOCKS; i++) {
+        struct lockprof_stats *s = &lock_table[i];
+        pthread_mutex_t *key = atomic_load_explicit(&s->key, memory_order_acquire);
+        if(key == NULL || s->acquisitions == 0) {
+            continue;
+        }
+        // racy snapshot, good enough for a report
+        unsigned long acq = s->acquisitions;
+        syslog(LOG_INFO, "lockprof %s (%p): acquisitions=%lu contended=%lu (%.1f%%) "
+                "wait avg=%lluns max=%lluns hold avg=%lluns max=%lluns",
+                s->name[0] ? s->name : "mutex", (void *)key, acq, s->contended,
+                100.0 * s->contended / acq,
+                s->wait_ns_total / acq, s->wait_ns_max,
+                s->hold_ns_total / acq, s->hold_ns_max);
+        log_histogram("wait", s->wait_hist);
+        log_histogram("hold", s->hold_hist);
+
+        struct lockprof_site sites[LOCKPROF_MAX_SITES];
+        memcpy(sites, s->sites, sizeof(sites));
+        qsort(sites, LOCKPROF_MAX_SITES, sizeof(sites[0]), compare_sites);
+        for(int j = 0; j < LOCKPROF_REPORT_SITES && sites[j].site; j++) {
+            syslog(LOG_INFO, "lockprof   contended at %s: %lu times, %lluns waited",
+                    sites[j].site, sites[j].contended, sites[j].wait_ns);
+        }
+    }
+}
+
+static void handle_sigusr1(int signo)
+{
+    (void)signo;
+    int saved_errno = errno;
+    char wake = 1;
+    // nonblocking: a full pipe already has a report pending
+    if(write(report_pipe[1], &wake, 1) < 0) {
+        // nothing to do from a signal handler
+    }
+    errno = saved_errno;
+}
+
+/* Writes the report on request, so an idle process still answers SIGUSR1 */
+static void *reporter_thread(void *arg)
+{
+    (void)arg;
+    char buf[64];
+    for(;;) {
+        ssize_t n = read(report_pipe[0], buf, sizeof(buf));
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        lockprof_dump();
+    }
+    return NULL;
+}
+
+void lockprof_install(void)
+{
+    pthread_t reporter;
+    pthread_attr_t attr;
+    if(pipe2(report_pipe, O_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "lockprof: pipe error %s", strerror(errno));
+        return;
+    }
+    fcntl(report_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&reporter, &attr, reporter_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if(rc != 0) {
+        syslog(LOG_ERR, "lockprof: reporter thread creation failed %s", strerror(rc));
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    // restart so the report request never surfaces as EINTR in the caller
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR1, &sa, NULL) == -1) {
+        syslog(LOG_ERR, "lockprof: error registering signal SIGUSR1 %s", strerror(errno));
+    }
+    atexit(lockprof_dump);
+}
+
+#endif /* AESD_LOCK_PROFILE */
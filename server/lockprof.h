@@ -0,0 +1,72 @@
+/*
+ * lockprof.h
+ *
+ * Drop-in wrappers for pthread_mutex_lock()/pthread_mutex_unlock() and the
+ * condition variable waits that can record per-lock contention statistics.
+ *
+ * Built with -DAESD_LOCK_PROFILE (make LOCK_PROFILE=1) every wrapped mutex
+ * gets an acquisition count, contended count, log2 histograms of wait and
+ * hold time and its most contended call sites.  The report goes to syslog
+ * on SIGUSR1 and at exit.  Without the flag the macros are plain pthread
+ * calls and lockprof.c compiles to nothing.
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+#ifdef AESD_LOCK_PROFILE
+
+#define LOCKPROF_STR2(x) #x
+#define LOCKPROF_STR(x) LOCKPROF_STR2(x)
+#define LOCKPROF_SITE __FILE__ ":" LOCKPROF_STR(__LINE__)
+
+int lockprof_lock(pthread_mutex_t *mutex, const char *site);
+int lockprof_trylock(pthread_mutex_t *mutex, const char *site);
+int lockprof_unlock(pthread_mutex_t *mutex);
+
+/**
+ * pthread_cond_timedwait() on a profiled @param mutex, or pthread_cond_wait()
+ * when @param abstime is NULL.  The hold ends before the wait and restarts
+ * once the mutex is reacquired, so sleeping on @param cond is not counted.
+ */
+int lockprof_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+        const struct timespec *abstime);
+
+/**
+ * Give @param mutex a readable @param name in the report.  The name is
+ * copied (up to 63 characters), so it may be freed afterwards.
+ */
+void lockprof_name(pthread_mutex_t *mutex, const char *name);
+
+/**
+ * Register the SIGUSR1 handler and the exit-time report.
+ */
+void lockprof_install(void);
+
+/**
+ * Write the report for every profiled mutex to syslog.
+ */
+void lockprof_dump(void);
+
+#define PROF_MUTEX_LOCK(m) lockprof_lock((m), LOCKPROF_SITE)
+#define PROF_MUTEX_TRYLOCK(m) lockprof_trylock((m), LOCKPROF_SITE)
+#define PROF_MUTEX_UNLOCK(m) lockprof_unlock(m)
+#define PROF_COND_WAIT(c, m) lockprof_cond_timedwait((c), (m), NULL)
+#define PROF_COND_TIMEDWAIT(c, m, t) lockprof_cond_timedwait((c), (m), (t))
+
+#else
+
+#define PROF_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define PROF_MUTEX_TRYLOCK(m) pthread_mutex_trylock(m)
+#define PROF_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define PROF_COND_WAIT(c, m) pthread_cond_wait((c), (m))
+#define PROF_COND_TIMEDWAIT(c, m, t) pthread_cond_timedwait((c), (m), (t))
+#define lockprof_name(m, name) ((void)(m), (void)(name))
+#define lockprof_install() ((void)0)
+#define lockprof_dump() ((void)0)
+
+#endif /* AESD_LOCK_PROFILE */
+
+#endif /* LOCKPROF_H */
@@ -0,0 +1,180 @@
+/*
+ * aesdstore-test.c
+ *
+ * Checks of the record store: record and time seeks against a brute force
+ * walk of the data file, reuse and validation of the saved index, torn tail
+ * recovery, and refusal to open a text file as a record store.
+ *
+ * Run with "make test" from the server directory.
+ */
+
+#include "../aesdstore.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define NUM_RECORDS 1000
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if(!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while(0)
+
+struct walked {
+    uint64_t offset;
+    uint64_t arrival_ns;
+};
+
+/* offsets and arrival times of every record, read straight from the file */
+static size_t walk(const char *path, struct walked *out, size_t max)
+{
+    int fd = open(path, O_RDONLY);
+    size_t n = 0;
+    uint64_t off = 0;
+    struct record_header hdr;
+    while(n < max && pread(fd, &hdr, sizeof(hdr), off) == sizeof(hdr)) {
+        out[n].offset = off;
+        out[n].arrival_ns = hdr.arrival_ns;
+        n++;
+        off += sizeof(hdr) + hdr.length;
+    }
+    close(fd);
+    return n;
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void check_seeks(struct aesd_store *store, const struct walked *w, size_t n, const char *when)
+{
+    uint64_t offset, record;
+    for(size_t i = 0; i <= n; i++) {
+        uint64_t want = i < n ? w[i].offset : store->size;
+        CHECK(store_seek_record(store, i, &offset) == 0 && offset == want,
+                "%s: seek_record(%zu) gave %llu, want %llu", when, i,
+                (unsigned long long)offset, (unsigned long long)want);
+    }
+    CHECK(store_seek_record(store, n + 1, &offset) == -1, "%s: seek past the end accepted", when);
+
+    // every recorded time, one before and one after
+    for(size_t i = 0; i < n; i++) {
+        for(int delta = -1; delta <= 1; delta++) {
+            uint64_t t = w[i].arrival_ns + delta;
+            size_t first = 0;
+            while(first < n && w[first].arrival_ns < t) {
+                first++;
+            }
+            uint64_t want = first < n ? w[first].offset : store->size;
+            CHECK(store_seek_time(store, t, &record, &offset) == 0 && record == first && offset == want,
+                    "%s: seek_time(%llu) gave record %llu, want %zu", when,
+                    (unsigned long long)t, (unsigned long long)record, first);
+        }
+    }
+    CHECK(store_seek_time(store, 0, &record, &offset) == 0 && record == 0 && offset == 0,
+            "%s: seek_time(0) did not find the first record", when);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/aesdstore-test-XXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char path[256], index_path[256], text_path[256];
+    snprintf(path, sizeof(path), "%s/data", dir);
+    snprintf(index_path, sizeof(index_path), "%s/data.idx", dir);
+    snprintf(text_path, sizeof(text_path), "%s/text", dir);
+    openlog("aesdstore-test", LOG_PERROR, LOG_USER);
+
+    struct aesd_store store;
+    CHECK(store_open(&store, path, STORE_FORMAT_RECORD) == 0, "open of a new store failed");
+    char buf[64];
+    for(int i = 0; i < NUM_RECORDS; i++) {
+        int len = snprintf(buf, sizeof(buf), "packet %d%s\n", i, i % 7 ? "" : " with a longer payload");
+        if(i % 10 == 9) {
+            // batched records share an arrival time
+            struct iovec batch[3] = {
+                { buf, len }, { buf, len }, { buf, len },
+            };
+            CHECK(store_append_batch(&store, RECORD_PACKET, 1, batch, 3) == 0, "batch append failed");
+        } else {
+            CHECK(store_append(&store, i % 50 ? RECORD_PACKET : RECORD_TIMESTAMP, 1, buf, len) == 0,
+                    "append failed");
+        }
+    }
+    static struct walked w[2 * NUM_RECORDS];
+    size_t n = walk(path, w, 2 * NUM_RECORDS);
+    CHECK(n == store.records, "walked %zu records, store has %llu", n, (unsigned long long)store.records);
+    check_seeks(&store, w, n, "fresh");
+    size_t index_len = store.index_len;
+    store_close(&store, 0);
+
+    // reopen: the saved index is reused and seeks give the same answers
+    CHECK(file_size(index_path) == (off_t)(index_len * sizeof(struct index_entry)), "index file size");
+    CHECK(store_open(&store, path, STORE_FORMAT_RECORD) == 0, "reopen failed");
+    CHECK(store.records == n && store.index_len == index_len, "reopen lost records or index entries");
+    check_seeks(&store, w, n, "reopened");
+    store_close(&store, 0);
+
+    // a stale index is detected and rebuilt from the data file
+    int fd = open(index_path, O_WRONLY);
+    struct index_entry bogus = { 64, 12345, 1 };
+    CHECK(pwrite(fd, &bogus, sizeof(bogus), sizeof(bogus)) == sizeof(bogus), "corrupting index");
+    close(fd);
+    CHECK(store_open(&store, path, STORE_FORMAT_RECORD) == 0, "open with a stale index failed");
+    CHECK(store.records == n && store.index_len == index_len, "rescan after a stale index");
+    check_seeks(&store, w, n, "stale index");
+    store_close(&store, 0);
+
+    // a torn trailing record after valid records is dropped
+    off_t full = file_size(path);
+    fd = open(path, O_WRONLY | O_APPEND);
+    struct record_header torn = { .length = 100, .type = RECORD_PACKET };
+    CHECK(write(fd, &torn, sizeof(torn)) == sizeof(torn) && write(fd, "partial", 7) == 7, "writing torn tail");
+    close(fd);
+    CHECK(store_open(&store, path, STORE_FORMAT_RECORD) == 0, "open with a torn tail failed");
+    CHECK(file_size(path) == full && store.records == n, "torn tail not dropped");
+    store_close(&store, 0);
+
+    // a text store must not be opened, or truncated, as a record store
+    CHECK(store_open(&store, text_path, STORE_FORMAT_TEXT) == 0, "open of a text store failed");
+    const char *ts = "timestamp:Mon, 19 Oct 2026 09:00:00 +0000\n";
+    CHECK(store_append(&store, RECORD_TIMESTAMP, 0, ts, strlen(ts)) == 0 &&
+            store_append(&store, RECORD_PACKET, 1, "hello\n", 6) == 0, "text append failed");
+    store_close(&store, 0);
+    off_t text_size = file_size(text_path);
+    CHECK(store_open(&store, text_path, STORE_FORMAT_RECORD) == -1, "text file opened as a record store");
+    CHECK(file_size(text_path) == text_size, "text file changed size to %lld", (long long)file_size(text_path));
+    // and neither is a file too short to hold one header
+    fd = open(text_path, O_WRONLY | O_TRUNC);
+    CHECK(write(fd, "short\n", 6) == 6, "writing short file");
+    close(fd);
+    CHECK(store_open(&store, text_path, STORE_FORMAT_RECORD) == -1, "short file opened as a record store");
+    CHECK(file_size(text_path) == 6, "short file was truncated");
+
+    unlink(path);
+    unlink(index_path);
+    unlink(text_path);
+    char text_index[300];
+    snprintf(text_index, sizeof(text_index), "%s.idx", text_path);
+    unlink(text_index);
+    rmdir(dir);
+
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * replication-test.c
+ *
+ * Runs a primary aesdsocket with two followers and checks that both
+ * followers serve exactly the primary's data, that a second process cannot
+ * open a data file already in use, and that stopping one follower leaves
+ * the other replicating.
+ *
+ * The primary uses the default data file, so no other aesdsocket may be
+ * running.  Run with "make test" from the server directory.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define WAIT_S 5
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if(!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while(0)
+
+static const char *server;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* start the server with the given options, NULL terminated */
+static pid_t start(const char *arg, ...)
+{
+    const char *argv[16] = { server };
+    int argc = 1;
+    va_list ap;
+    va_start(ap, arg);
+    for(; arg != NULL && argc < 15; arg = va_arg(ap, const char *)) {
+        argv[argc++] = arg;
+    }
+    va_end(ap);
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if(pid == 0) {
+        execv(server, (char **)argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop(pid_t pid)
+{
+    if(pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static int connect_port(int port)
+{
+    char service[16];
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if(getaddrinfo("127.0.0.1", service, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Send one packet and collect the reply into @param out, dropping the
+ * periodic timestamp lines.  Returns -1 when the server is not reachable.
+ */
+static int exchange(int port, const char *packet, char *out, size_t size)
+{
+    int fd = connect_port(port);
+    out[0] = '\0';
+    if(fd < 0) {
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t n = send(fd, packet, strlen(packet), MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    while(n >= 0 && len < size - 1 && (n = recv(fd, out + len, size - 1 - len, 0)) > 0) {
+        len += n;
+    }
+    close(fd);
+    out[len] = '\0';
+    char *line = out, *kept = out;
+    while(*line) {
+        char *end = strchr(line, '\n');
+        size_t line_len = end ? (size_t)(end - line + 1) : strlen(line);
+        if(strncmp(line, "timestamp:", 10) != 0) {
+            memmove(kept, line, line_len);
+            kept += line_len;
+        }
+        line += line_len;
+    }
+    *kept = '\0';
+    return 0;
+}
+
+static int wait_listening(int port)
+{
+    double deadline = now_s() + WAIT_S;
+    while(now_s() < deadline) {
+        int fd = connect_port(port);
+        if(fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        usleep(20000);
+    }
+    return -1;
+}
+
+/*
+ * Poll a follower until it serves @param expected, followers apply frames
+ * asynchronously.  Any packet triggers the replay, none is appended.
+ */
+static int follower_serves(int port, const char *expected, char *out, size_t size)
+{
+    double deadline = now_s() + WAIT_S;
+    do {
+        if(exchange(port, "\n", out, size) == 0 && strcmp(out, expected) == 0) {
+            return 1;
+        }
+        usleep(50000);
+    } while(now_s() < deadline);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/aesdrepl-test.XXXXXX";
+    char endpoint[64], port[3][16], second_port[16], out[4096];
+    int base = 20000 + getpid() % 20000;
+
+    server = argc > 1 ? argv[1] : "./aesdsocket";
+    if(access(server, X_OK) != 0 || mkdtemp(dir) == NULL) {
+        printf("FAIL cannot run %s : %s\n", server, strerror(errno));
+        return 1;
+    }
+    snprintf(endpoint, sizeof(endpoint), "%s/repl.sock", dir);
+    for(int i = 0; i < 3; i++) {
+        snprintf(port[i], sizeof(port[i]), "%d", base + 100 * i);
+    }
+    snprintf(second_port, sizeof(second_port), "%d", base + 300);
+
+    pid_t primary = start("-p", port[0], "-R", endpoint, NULL);
+    CHECK(wait_listening(base) == 0, "primary is not listening");
+    pid_t follower[2] = {
+        start("-p", port[1], "-F", endpoint, NULL),
+        start("-p", port[2], "-F", endpoint, NULL),
+    };
+    CHECK(wait_listening(base + 100) == 0 && wait_listening(base + 200) == 0,
+            "followers are not listening");
+
+    CHECK(exchange(base, "a1\n", out, sizeof(out)) == 0, "primary unreachable");
+    CHECK(exchange(base, "a2\n", out, sizeof(out)) == 0 && strcmp(out, "a1\na2\n") == 0,
+            "primary replied \"%s\"", out);
+    // each follower keeps its own replica, a shared one would double every line
+    for(int i = 0; i < 2; i++) {
+        CHECK(follower_serves(base + 100 * (i + 1), "a1\na2\n", out, sizeof(out)),
+                "follower %d served \"%s\"", i + 1, out);
+    }
+
+    // the primary's data file is locked, a second primary must refuse it
+    pid_t second = start("-p", second_port, NULL);
+    int status = 0;
+    double deadline = now_s() + WAIT_S;
+    pid_t reaped;
+    while((reaped = waitpid(second, &status, WNOHANG)) == 0 && now_s() < deadline) {
+        usleep(20000);
+    }
+    CHECK(reaped == second && WIFEXITED(status) && WEXITSTATUS(status) != 0,
+            "second primary on the same data file did not exit with failure");
+    if(reaped != second) {
+        stop(second);
+    }
+
+    // stopping one follower removes only its own replica
+    stop(follower[0]);
+    CHECK(exchange(base, "a3\n", out, sizeof(out)) == 0 && strcmp(out, "a1\na2\na3\n") == 0,
+            "primary replied \"%s\" after a follower stopped", out);
+    CHECK(follower_serves(base + 200, "a1\na2\na3\n", out, sizeof(out)),
+            "remaining follower served \"%s\"", out);
+
+    stop(follower[1]);
+    stop(primary);
+    unlink(endpoint);
+    rmdir(dir);
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}